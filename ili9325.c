@@ -5,14 +5,15 @@
  * Copyright 2020 Noralf Trønnes
  */
 
+#include <linux/bitmap.h>
 #include <linux/debugfs.h>
 #include <linux/delay.h>
-#include <linux/dma-buf.h>
 #include <linux/dma-mapping.h>
 #include <linux/gpio/consumer.h>
 #include <linux/module.h>
 #include <linux/property.h>
 #include <linux/regmap.h>
+#include <linux/sizes.h>
 #include <linux/spi/spi.h>
 #include <asm/unaligned.h>
 
@@ -24,16 +25,132 @@
 #include <drm/drm_drv.h>
 #include <drm/drm_fb_cma_helper.h>
 #include <drm/drm_fb_helper.h>
-#include <drm/drm_format_helper.h>
 #include <drm/drm_fourcc.h>
 #include <drm/drm_framebuffer.h>
 #include <drm/drm_gem_cma_helper.h>
 #include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_modeset_helper.h>
 #include <drm/drm_probe_helper.h>
 #include <drm/drm_rect.h>
 #include <drm/drm_simple_kms_helper.h>
 #include <drm/drm_vblank.h>
 
+#include "tinydrm-helpers.h"
+
+/*
+ * Register access is done with 3 byte frames: the startbyte followed by a
+ * 16-bit word, MSB first. This is what the controller sees when the word is
+ * sent with 16 bits per word, so the frames can always go out as bytes and
+ * no byte swapping is necessary.
+ */
+#define ILI9325_FRAME_LEN	3
+
+/* Number of register writes that can be batched in one message */
+#define ILI9325_QUEUE_LEN	64
+
+/* Index and data frames plus a register read */
+#define ILI9325_QUEUE_XFERS	(2 * ILI9325_QUEUE_LEN + 1)
+
+/* Pixels read back to check the pixel clock, after 2 dummy bytes and a dummy pixel */
+#define ILI9325_VERIFY_PIXELS	16
+#define ILI9325_VERIFY_LEN	(4 + ILI9325_VERIFY_PIXELS * 2)
+
+static bool async;
+module_param(async, bool, 0444);
+MODULE_PARM_DESC(async, "Convert the next frame while the previous is transferred (default: false)");
+
+static bool stream;
+module_param(stream, bool, 0444);
+MODULE_PARM_DESC(stream, "Convert and send in bands using small buffers, overrides async (default: false)");
+
+static bool shadow;
+module_param(shadow, bool, 0444);
+MODULE_PARM_DESC(shadow, "Keep a copy of the display and only send what changed, overrides stream (default: false)");
+
+static unsigned int calibrate;
+module_param(calibrate, uint, 0444);
+MODULE_PARM_DESC(calibrate, "Find the fastest pixel clock up to this many MHz using GRAM readback (default: 0 = off)");
+
+static bool autotune = true;
+module_param(autotune, bool, 0444);
+MODULE_PARM_DESC(autotune, "Benchmark the transport on first enable and use the fastest settings (default: true)");
+
+/*
+ * Amount of pixel data used to time the transport, the fastest run counts.
+ * This runs in the first commit, so it's kept to a few chunks per candidate.
+ */
+#define ILI9325_TUNE_LEN	SZ_16K
+#define ILI9325_TUNE_RUNS	2
+/* Number of small writes timed per length */
+#define ILI9325_TUNE_SMALL_COUNT	8
+
+/* Candidates, limited by the controller's maximum transfer size */
+static const size_t ili9325_tune_chunks[] = { SZ_16K, SZ_8K, SZ_4K };
+/* Small writes that are timed at the register clock and the pixel clock */
+static const size_t ili9325_tune_small[] = { 64, 256, 1024 };
+
+/* Benchmark results in ns, zero if not run */
+struct ili9325_tune {
+	u64 bpw_ns[2];
+	u64 chunk_ns[ARRAY_SIZE(ili9325_tune_chunks)];
+	u64 slow_ns[ARRAY_SIZE(ili9325_tune_small)];
+	u64 fast_ns[ARRAY_SIZE(ili9325_tune_small)];
+};
+
+/*
+ * Flush cost model: time = setup + bytes * per byte. It is fitted to measured
+ * flushes with least squares where older samples decay by 1/8 per flush.
+ */
+#define ILI9325_COST_WEIGHT	16
+#define ILI9325_COST_SETUP_NS	100000
+
+struct ili9325_cost {
+	u64 sum_w;
+	u64 sum_x;
+	u64 sum_y;
+	u64 sum_xx;
+	u64 sum_xy;
+	u32 setup_ns;
+	u32 byte_ps;
+};
+
+/* Buffer for sending a repeated row or a solid colour */
+#define ILI9325_FILL_SIZE	SZ_8K
+
+/* Number of bounce buffers in stream mode */
+#define ILI9325_NUM_BANDS	3
+
+/* Upper limit for the size of a band, keeps the bounce buffers in cache */
+#define ILI9325_BAND_SIZE	SZ_8K
+
+/* A band of rows in stream mode: startbyte and pixel data */
+struct ili9325_band {
+	struct spi_message msg;
+	struct spi_transfer xfers[2];
+	struct completion done;
+	bool busy;
+	void *buf;
+};
+
+/*
+ * Preallocated buffers for the transport so register access doesn't have to
+ * allocate. Each member is only written by the CPU while no transfer is using
+ * it and the structure is cacheline aligned to keep it DMA safe.
+ */
+struct ili9325_cmdbuf {
+	/* Index and data frames for the queued register writes */
+	u8 frames[2 * ILI9325_QUEUE_LEN][ILI9325_FRAME_LEN];
+	/* Header for pixel data */
+	u8 startbyte;
+	/* Startbyte, dummy byte and the 16-bit value */
+	u8 read_tx[4];
+	/* Startbyte and dummy bytes for reading back pixels */
+	u8 verify_tx[ILI9325_VERIFY_LEN];
+	/* Keep the receive buffers on their own cacheline */
+	u8 read_rx[4] ____cacheline_aligned;
+	u8 verify_rx[ILI9325_VERIFY_LEN];
+} ____cacheline_aligned;
+
 struct tinydrm_ili9325 {
 	struct drm_device drm;
 	struct drm_simple_display_pipe pipe;
@@ -42,13 +159,74 @@ struct tinydrm_ili9325 {
 	struct spi_device *spi;
 	unsigned int devcode;
 	bool enabled;
-	void *tx_buf;
+	/* Clock for pixel data, can be calibrated and backs off on readback errors */
+	u32 pixel_speed_hz;
+	/* When to read back pixel data next, see ili9325_verify() */
+	unsigned long verify_next;
+	/* Updates the mode clock when the pixel clock has changed */
+	struct work_struct mode_work;
+	bool calibrated;
+	bool tuned;
+	/* The controller is in sleep mode and holds the cached register state */
+	bool asleep;
+	/* The second buffer is only used in async mode, neither in stream mode */
+	void *tx_buf[2];
+	unsigned int tx_idx;
+	bool stream;
+	struct ili9325_band bands[ILI9325_NUM_BANDS];
+	size_t band_size;
+	/* Converted rows for repeated row rects, protected by being sent synchronously */
+	void *fill_buf;
+	/* Scratch for a framebuffer line, used to find repeated rows */
+	void *row_buf;
+	/* What the display shows in the format it's sent, used by shadow mode */
+	u16 *shadow;
+	/* Converted band for diffing against the shadow */
+	u16 *diff_buf;
+	bool shadow_valid;
 	bool swap_bytes;
 	unsigned int rotation;
 	unsigned int set_win_type;
 	struct gpio_desc *reset;
 	struct backlight_device *backlight;
 	struct regulator *regulator;
+	struct tinydrm_seq init_seq;
+
+	/* Serializes register access and protects @cmdbuf and the queue */
+	struct mutex cmdlock;
+
+	/* Transfers that are batched up and sent as one message */
+	struct spi_message queue_msg;
+	struct spi_transfer *queue_xfers;
+	unsigned int queue_num_xfers;
+	unsigned int queue_num_frames;
+	int queue_error;
+	/* Register cache, writes go through the queue */
+	struct regmap *regmap;
+	/* Registers written since the last reset, the cache is only valid for those */
+	DECLARE_BITMAP(reg_written, 0x100);
+	/* Set while the queue message is sent asynchronously */
+	bool queue_busy;
+	struct completion queue_done;
+
+	/* Pixel data transfers, set up once by ili9325_pixel_xfers_prepare() */
+	struct spi_transfer pixel_header;
+	struct spi_transfer *pixel_xfers;
+	unsigned int pixel_num_xfers;
+
+	/* Transport strategy, see ili9325_autotune() */
+	u8 pixel_bpw;
+	size_t pixel_max_chunk;
+	/* Pixel data up to this length is sent at the register clock */
+	size_t slow_max_len;
+	struct ili9325_tune tune;
+	/* Decides whether to flush damage clips separately or merged */
+	struct ili9325_cost cost;
+	/* Flushes in the background so commits don't wait for the transfer */
+	struct tinydrm_flush flush;
+
+	/* DMA-safe command and header buffers, protected by @cmdlock */
+	struct ili9325_cmdbuf cmdbuf;
 };
 
 static inline struct tinydrm_ili9325 *
@@ -63,331 +241,1610 @@ static u8 ili9325_get_startbyte(bool id, bool rs, bool read)
 	return 0x70 | (id << 2) | (rs << 1) | read;
 }
 
-static int ili9325_spi_transfer(struct tinydrm_ili9325 *ili9325,
-				u8 startbyte, const void *buf, size_t len)
+static u32 ili9325_norm_speed_hz(struct tinydrm_ili9325 *ili9325)
 {
-	struct spi_device *spi = ili9325->spi;
 	/* For reliability only run pixel data above spec */
-	u32 norm_speed_hz = min_t(u32, 10000000, spi->max_speed_hz);
-	struct spi_transfer header = {
-		.speed_hz = norm_speed_hz,
-		.bits_per_word = 8,
-		.len = 1,
-	};
-	struct spi_transfer tr = {
-		.bits_per_word = 16,
-	};
-	struct spi_message m;
-	size_t max_chunk;
-	u8 *startbytebuf;
-	size_t chunk;
-	int ret = 0;
+	return min_t(u32, 10000000, ili9325->spi->max_speed_hz);
+}
+
+/*
+ * Userspace sizes its frame budget from the mode refresh rate. The new rate
+ * shows up the next time the modes are probed. There's no hotplug event, that
+ * would have userspace reprobe and maybe do a modeset for a change that
+ * doesn't affect the picture. This runs from a worker since the clock changes
+ * from within commits and the mode is protected by the mode config mutex.
+ */
+static void ili9325_mode_work(struct work_struct *work)
+{
+	struct tinydrm_ili9325 *ili9325 = container_of(work, struct tinydrm_ili9325, mode_work);
+	struct drm_device *drm = &ili9325->drm;
+
+	mutex_lock(&drm->mode_config.mutex);
+	tinydrm_mode_set_bus_clock(&ili9325->mode, ili9325->pixel_speed_hz, 16);
+	mutex_unlock(&drm->mode_config.mutex);
+}
+
+/* Step the pixel clock down after pixel data has been read back wrong */
+static void ili9325_pixel_speed_backoff(struct tinydrm_ili9325 *ili9325)
+{
+	u32 speed, min_speed = ili9325_norm_speed_hz(ili9325);
+
+	if (ili9325->pixel_speed_hz <= min_speed)
+		return;
+
+	speed = max(ili9325->pixel_speed_hz / 5 * 4, min_speed);
+	dev_warn(&ili9325->spi->dev, "Lowering pixel clock to %u kHz\n", speed / 1000);
+	ili9325->pixel_speed_hz = speed;
+	schedule_work(&ili9325->mode_work);
+}
+
+static void ili9325_fill_frame(u8 *frame, u8 startbyte, u16 val)
+{
+	frame[0] = startbyte;
+	put_unaligned_be16(val, &frame[1]);
+}
+
+/*
+ * Pixel data is sent as the startbyte followed by a chain of transfers that
+ * covers the buffer. The transfers only need the buffer pointer and length
+ * filled in, so they are set up once and reused for every flush.
+ */
+static void ili9325_set_bpw(struct tinydrm_ili9325 *ili9325, u8 bpw)
+{
+	ili9325->pixel_bpw = bpw;
+#ifdef __LITTLE_ENDIAN
+	/* The controller wants the MSB first, with 8 bits per word the CPU swaps */
+	ili9325->swap_bytes = bpw == 8;
+#endif
+}
 
-	if (len <= 64)
-		tr.speed_hz = norm_speed_hz;
+/* Keep the 16-bit words within one transfer */
+static size_t ili9325_max_chunk(struct tinydrm_ili9325 *ili9325)
+{
+	return round_down(spi_max_transfer_size(ili9325->spi), 2);
+}
+
+static int ili9325_pixel_xfers_prepare(struct tinydrm_ili9325 *ili9325,
+				       size_t max_len)
+{
+	struct spi_device *spi = ili9325->spi;
+	struct spi_transfer *tr;
+	unsigned int num;
+
+	ili9325_set_bpw(ili9325, spi_is_bpw_supported(spi, 16) ? 16 : 8);
+	ili9325->pixel_max_chunk = ili9325_max_chunk(ili9325);
+	ili9325->slow_max_len = 64;
 
-	/* Bytes have already been swapped if necessary */
-	if (!spi_is_bpw_supported(ili9325->spi, 16))
-		tr.bits_per_word = 8;
+	/* Room for the smallest chunk size autotuning can pick */
+	num = DIV_ROUND_UP(max_len, min_t(size_t, ili9325->pixel_max_chunk,
+					  ili9325_tune_chunks[ARRAY_SIZE(ili9325_tune_chunks) - 1]));
 
-	startbytebuf = kmalloc(1, GFP_KERNEL);
-	if (!startbytebuf)
+	ili9325->pixel_xfers = devm_kcalloc(&spi->dev, num, sizeof(*tr),
+					    GFP_KERNEL);
+	if (!ili9325->pixel_xfers)
 		return -ENOMEM;
 
-	header.tx_buf = startbytebuf;
-	*startbytebuf = startbyte;
+	ili9325->pixel_num_xfers = num;
+
+	tr = &ili9325->pixel_header;
+	tr->tx_buf = &ili9325->cmdbuf.startbyte;
+	tr->len = 1;
+	tr->speed_hz = ili9325_norm_speed_hz(ili9325);
+	tr->bits_per_word = 8;
+
+	return 0;
+}
 
-	max_chunk = spi_max_transfer_size(spi);
+static int ili9325_bands_prepare(struct tinydrm_ili9325 *ili9325)
+{
+	struct device *dev = &ili9325->spi->dev;
+	unsigned int i;
 
-	spi_message_init(&m);
-	spi_message_add_tail(&header, &m);
-	spi_message_add_tail(&tr, &m);
+	/* A band must hold at least one row */
+	ili9325->band_size = min_t(size_t, ILI9325_BAND_SIZE,
+				   ili9325->pixel_max_chunk);
+	if (ili9325->band_size < 320 * 2)
+		return -EINVAL;
 
-	while (len) {
-		chunk = min(len, max_chunk);
+	for (i = 0; i < ILI9325_NUM_BANDS; i++) {
+		struct ili9325_band *band = &ili9325->bands[i];
 
-		tr.tx_buf = buf;
-		tr.len = chunk;
+		band->buf = devm_kmalloc(dev, ili9325->band_size, GFP_KERNEL);
+		if (!band->buf)
+			return -ENOMEM;
 
-		ret = spi_sync(spi, &m);
-		if (ret)
-			goto err_free;
+		init_completion(&band->done);
+		band->xfers[0] = ili9325->pixel_header;
+		band->xfers[1].tx_buf = band->buf;
+	}
 
-		buf += chunk;
-		len -= chunk;
+	return 0;
+}
+
+static void ili9325_band_complete(void *context)
+{
+	struct ili9325_band *band = context;
+
+	complete(&band->done);
+}
+
+static void ili9325_band_wait(struct tinydrm_ili9325 *ili9325,
+			      struct ili9325_band *band)
+{
+	int ret;
+
+	if (!band->busy)
+		return;
+
+	wait_for_completion(&band->done);
+	band->busy = false;
+
+	ret = band->msg.status;
+	if (ret) {
+		dev_err_once(&ili9325->spi->dev, "Failed to update display %d\n", ret);
+		ili9325->shadow_valid = false;
 	}
+}
 
-err_free:
-	kfree(startbytebuf);
+/*
+ * The queue collects register accesses and sends them in one message with
+ * chip select toggled between the frames. It's used like this:
+ *
+ *	ili9325_queue_begin(ili9325);
+ *	ili9325_queue_write(ili9325, reg, val);
+ *	...
+ *	ret = ili9325_queue_end(ili9325);
+ *
+ * The first error is kept and returned by ili9325_queue_flush() and
+ * ili9325_queue_end().
+ */
+static void ili9325_queue_reset(struct tinydrm_ili9325 *ili9325)
+{
+	spi_message_init(&ili9325->queue_msg);
+	ili9325->queue_num_xfers = 0;
+	ili9325->queue_num_frames = 0;
+}
+
+/* Keep the first error */
+static void ili9325_queue_set_error(struct tinydrm_ili9325 *ili9325, int ret)
+{
+	if (ret && !ili9325->queue_error)
+		ili9325->queue_error = ret;
+}
+
+static struct spi_transfer *ili9325_queue_add(struct tinydrm_ili9325 *ili9325)
+{
+	struct spi_transfer *tr;
+
+	tr = &ili9325->queue_xfers[ili9325->queue_num_xfers++];
+	memset(tr, 0, sizeof(*tr));
+	spi_message_add_tail(tr, &ili9325->queue_msg);
+
+	return tr;
+}
+
+/* Send what's queued, the queue is still open afterwards */
+static int ili9325_queue_flush(struct tinydrm_ili9325 *ili9325)
+{
+	struct spi_message *m = &ili9325->queue_msg;
+	int ret;
+
+	lockdep_assert_held(&ili9325->cmdlock);
+
+	if (list_empty(&m->transfers))
+		return ili9325->queue_error;
+
+	/* Don't leave chip select asserted after the message */
+	list_last_entry(&m->transfers, struct spi_transfer,
+			transfer_list)->cs_change = 0;
+
+	ret = spi_sync(ili9325->spi, m);
+	ili9325_queue_set_error(ili9325, ret);
+
+	ili9325_queue_reset(ili9325);
+
+	return ili9325->queue_error;
+}
+
+static void ili9325_queue_complete(void *context)
+{
+	struct tinydrm_ili9325 *ili9325 = context;
+
+	complete(&ili9325->queue_done);
+}
+
+/* Wait for asynchronous messages to finish */
+static void ili9325_queue_wait(struct tinydrm_ili9325 *ili9325)
+{
+	unsigned int i;
+	int ret;
+
+	lockdep_assert_held(&ili9325->cmdlock);
+
+	for (i = 0; i < ILI9325_NUM_BANDS; i++)
+		ili9325_band_wait(ili9325, &ili9325->bands[i]);
+
+	if (!ili9325->queue_busy)
+		return;
+
+	wait_for_completion(&ili9325->queue_done);
+	ili9325->queue_busy = false;
+
+	ret = ili9325->queue_msg.status;
+	if (ret) {
+		dev_err_once(&ili9325->spi->dev, "Failed to update display %d\n", ret);
+		ili9325->shadow_valid = false;
+	}
+}
+
+static void ili9325_queue_begin(struct tinydrm_ili9325 *ili9325)
+{
+	mutex_lock(&ili9325->cmdlock);
+	ili9325_queue_wait(ili9325);
+	ili9325->queue_error = 0;
+	ili9325_queue_reset(ili9325);
+}
+
+static int ili9325_queue_end(struct tinydrm_ili9325 *ili9325)
+{
+	int ret;
+
+	ret = ili9325_queue_flush(ili9325);
+	mutex_unlock(&ili9325->cmdlock);
 
 	return ret;
 }
 
-static int ili9325_write_index(struct tinydrm_ili9325 *ili9325, u16 index)
+/*
+ * Send what's queued without waiting for it to finish. Nothing more can be
+ * queued until the next ili9325_queue_begin() which waits for the message to
+ * complete.
+ */
+static int ili9325_queue_submit(struct tinydrm_ili9325 *ili9325)
 {
-	u8 startbyte;
-	u16 *buf;
+	struct spi_message *m = &ili9325->queue_msg;
 	int ret;
 
-	buf = kmalloc(sizeof(*buf), GFP_KERNEL);
-	if (!buf)
-		return -ENOMEM;
+	lockdep_assert_held(&ili9325->cmdlock);
 
-	if (ili9325->swap_bytes)
-		*buf = swab16(index);
-	else
-		*buf = index;
+	if (ili9325->queue_error || list_empty(&m->transfers))
+		return ili9325->queue_error;
 
-	startbyte = ili9325_get_startbyte(0, 0, 0);
-	ret = ili9325_spi_transfer(ili9325, startbyte, buf, sizeof(*buf));
-	kfree(buf);
+	list_last_entry(&m->transfers, struct spi_transfer,
+			transfer_list)->cs_change = 0;
+
+	m->complete = ili9325_queue_complete;
+	m->context = ili9325;
+	reinit_completion(&ili9325->queue_done);
+
+	ret = spi_async(ili9325->spi, m);
+	ili9325_queue_set_error(ili9325, ret);
+	if (!ret)
+		ili9325->queue_busy = true;
+
+	return ili9325->queue_error;
+}
+
+static int ili9325_queue_end_async(struct tinydrm_ili9325 *ili9325)
+{
+	int ret;
+
+	ret = ili9325_queue_submit(ili9325);
+	mutex_unlock(&ili9325->cmdlock);
 
 	return ret;
 }
 
-static int ili9325_writebuf(struct tinydrm_ili9325 *ili9325, u16 reg,
-			    const void *buf, size_t len)
+/* Wait for the display to be idle */
+static void ili9325_queue_sync(struct tinydrm_ili9325 *ili9325)
 {
-	u8 startbyte;
+	mutex_lock(&ili9325->cmdlock);
+	ili9325_queue_wait(ili9325);
+	mutex_unlock(&ili9325->cmdlock);
+}
+
+static void ili9325_queue_frame(struct tinydrm_ili9325 *ili9325,
+				u8 startbyte, u16 val)
+{
+	struct spi_transfer *tr;
+	u8 *frame;
+
+	if (ili9325->queue_num_frames == ARRAY_SIZE(ili9325->cmdbuf.frames))
+		ili9325_queue_flush(ili9325);
+
+	frame = ili9325->cmdbuf.frames[ili9325->queue_num_frames++];
+	ili9325_fill_frame(frame, startbyte, val);
+
+	tr = ili9325_queue_add(ili9325);
+	tr->tx_buf = frame;
+	tr->len = ILI9325_FRAME_LEN;
+	tr->speed_hz = ili9325_norm_speed_hz(ili9325);
+	tr->bits_per_word = 8;
+	/* Each frame ends by deasserting chip select */
+	tr->cs_change = 1;
+	tr->cs_change_delay.value = 1;
+	tr->cs_change_delay.unit = SPI_DELAY_UNIT_USECS;
+}
+
+/* Queue a register write bypassing the register cache */
+static void ili9325_queue_raw_write(struct tinydrm_ili9325 *ili9325,
+				    u16 reg, u16 val)
+{
+	ili9325_queue_frame(ili9325, ili9325_get_startbyte(0, 0, 0), reg);
+	ili9325_queue_frame(ili9325, ili9325_get_startbyte(0, 1, 0), val);
+}
+
+/* Read a register bypassing the register cache, this sends the queue */
+static int ili9325_queue_raw_read(struct tinydrm_ili9325 *ili9325,
+				  u16 reg, u16 *val)
+{
+	struct spi_device *spi = ili9325->spi;
+	struct ili9325_cmdbuf *cmdbuf = &ili9325->cmdbuf;
+	struct spi_transfer *tr;
 	int ret;
 
-	ret = ili9325_write_index(ili9325, reg);
-	if (ret)
-		return ret;
+	ili9325_queue_frame(ili9325, ili9325_get_startbyte(0, 0, 0), reg);
+
+	/* Startbyte, dummy byte and the value in one full duplex transfer */
+	tr = ili9325_queue_add(ili9325);
+	tr->tx_buf = cmdbuf->read_tx;
+	tr->rx_buf = cmdbuf->read_rx;
+	tr->speed_hz = min_t(u32, 5000000, spi->max_speed_hz / 2);
+	tr->bits_per_word = 8;
+	tr->len = sizeof(cmdbuf->read_tx);
+
+	ret = ili9325_queue_flush(ili9325);
+	/* throw away startbyte and dummy byte */
+	if (!ret)
+		*val = get_unaligned_be16(&cmdbuf->read_rx[2]);
+
+	return ret;
+}
+
+/*
+ * The register cache sits on top of the queue: regmap is only used with the
+ * queue open and its writes end up as queued frames.
+ */
+static int ili9325_regmap_reg_write(void *context, unsigned int reg,
+				    unsigned int val)
+{
+	struct tinydrm_ili9325 *ili9325 = context;
+
+	lockdep_assert_held(&ili9325->cmdlock);
+	ili9325_queue_raw_write(ili9325, reg, val);
+
+	return 0;
+}
+
+static int ili9325_regmap_reg_read(void *context, unsigned int reg,
+				   unsigned int *val)
+{
+	struct tinydrm_ili9325 *ili9325 = context;
+	u16 val16;
+	int ret;
+
+	lockdep_assert_held(&ili9325->cmdlock);
+	ret = ili9325_queue_raw_read(ili9325, reg, &val16);
+	if (!ret)
+		*val = val16;
+
+	return ret;
+}
+
+static const struct regmap_bus ili9325_regmap_bus = {
+	.reg_write = ili9325_regmap_reg_write,
+	.reg_read = ili9325_regmap_reg_read,
+};
+
+static bool ili9325_regmap_readable_reg(struct device *dev, unsigned int reg)
+{
+	/* GRAM data */
+	return reg != 0x22;
+}
+
+/*
+ * Every register is cached, including the GRAM address counter which changes
+ * when pixels are written. The address counter is always written with
+ * ili9325_queue_write() which goes to the hardware even if the value is
+ * unchanged, so the cache never has to be read back from the controller.
+ */
+static const struct regmap_config ili9325_regmap_config = {
+	.reg_bits = 16,
+	.val_bits = 16,
+	.max_register = 0xff,
+	.readable_reg = ili9325_regmap_readable_reg,
+	.cache_type = REGCACHE_FLAT,
+};
+
+static void ili9325_queue_write(struct tinydrm_ili9325 *ili9325,
+				u16 reg, u16 val)
+{
+	ili9325_queue_set_error(ili9325, regmap_write(ili9325->regmap, reg, val));
+	set_bit(reg, ili9325->reg_written);
+}
+
+/*
+ * Only write the register if the value differs from the cached value. The
+ * cached value is only trusted once the register has been written after the
+ * last reset, since a reset restores the defaults behind the cache's back.
+ */
+static void ili9325_queue_update(struct tinydrm_ili9325 *ili9325,
+				 u16 reg, u16 val)
+{
+	int ret;
+
+	if (!test_bit(reg, ili9325->reg_written)) {
+		ili9325_queue_write(ili9325, reg, val);
+		return;
+	}
+
+	ret = regmap_update_bits(ili9325->regmap, reg, 0xffff, val);
+	ili9325_queue_set_error(ili9325, ret);
+}
+
+/* Send what's queued and sleep */
+static void ili9325_queue_msleep(struct tinydrm_ili9325 *ili9325,
+				 unsigned int ms)
+{
+	ili9325_queue_flush(ili9325);
+	msleep(ms);
+}
+
+/*
+ * Init sequences have 2 byte register numbers and each write has a 2 byte
+ * value, MSB first. Writes are batched up between the delays.
+ */
+#define ILI9325_SEQ_WRITE(reg, val)	(reg) >> 8, (reg) & 0xff, 2, \
+					((val) >> 8) & 0xff, (val) & 0xff
+#define ILI9325_SEQ_DELAY(ms)		0x00, 0x00, 1, (ms)
+
+static int ili9325_seq_validate(struct device *dev, const struct tinydrm_seq *seq)
+{
+	unsigned int i;
+
+	for (i = 0; i < seq->num_cmds; i++) {
+		const struct tinydrm_seq_cmd *cmd = &seq->cmds[i];
+
+		if (tinydrm_seq_cmd_is_delay(cmd))
+			continue;
+
+		if (cmd->len != 2 || cmd->cmd > ili9325_regmap_config.max_register) {
+			dev_err(dev, "Illegal register write %u in init sequence\n", i);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static void ili9325_queue_seq(struct tinydrm_ili9325 *ili9325,
+			      const struct tinydrm_seq *seq)
+{
+	unsigned int i;
+
+	for (i = 0; i < seq->num_cmds; i++) {
+		const struct tinydrm_seq_cmd *cmd = &seq->cmds[i];
+
+		if (tinydrm_seq_cmd_is_delay(cmd))
+			ili9325_queue_msleep(ili9325, cmd->params[0]);
+		else
+			ili9325_queue_write(ili9325, cmd->cmd,
+					    get_unaligned_be16(cmd->params));
+	}
+}
+
+static void ili9325_queue_pixels(struct tinydrm_ili9325 *ili9325, u16 reg,
+				 const void *buf, size_t len, size_t max_chunk,
+				 bool repeat)
+{
+	struct spi_message *m = &ili9325->queue_msg;
+	struct spi_transfer *tr;
+	unsigned int i;
+	u32 speed_hz;
+	size_t chunk;
+
+	if (WARN_ON_ONCE(DIV_ROUND_UP(len, max_chunk) > ili9325->pixel_num_xfers)) {
+		ili9325_queue_set_error(ili9325, -EINVAL);
+		return;
+	}
+
+	ili9325_queue_frame(ili9325, ili9325_get_startbyte(0, 0, 0), reg);
+	spi_message_add_tail(&ili9325->pixel_header, m);
+
+	/* For reliability only run pixel data above spec */
+	speed_hz = len <= ili9325->slow_max_len ?
+		   ili9325_norm_speed_hz(ili9325) : ili9325->pixel_speed_hz;
+
+	for (i = 0; len; i++) {
+		chunk = min(len, max_chunk);
+
+		tr = &ili9325->pixel_xfers[i];
+		tr->tx_buf = buf;
+		tr->len = chunk;
+		tr->speed_hz = speed_hz;
+		tr->bits_per_word = ili9325->pixel_bpw;
+		spi_message_add_tail(tr, m);
+
+		if (!repeat)
+			buf += chunk;
+		len -= chunk;
+	}
+}
+
+/*
+ * Write a buffer to @reg. The buffer is sent in the same message as the queued
+ * register writes, so this must be the last thing queued before the queue is
+ * sent.
+ */
+static void ili9325_queue_writebuf(struct tinydrm_ili9325 *ili9325, u16 reg,
+				   const void *buf, size_t len)
+{
+	ili9325_queue_pixels(ili9325, reg, buf, len, ili9325->pixel_max_chunk, false);
+}
+
+/*
+ * Write @len bytes to @reg by sending @buf over and over, the transfers point
+ * at the same buffer. Same rules as ili9325_queue_writebuf().
+ */
+static void ili9325_queue_writebuf_repeat(struct tinydrm_ili9325 *ili9325, u16 reg,
+					  const void *buf, size_t buf_len, size_t len)
+{
+	ili9325_queue_pixels(ili9325, reg, buf, len, buf_len, true);
+}
+
+static int ili9325_write(struct tinydrm_ili9325 *ili9325, u16 reg, u16 val)
+{
+	ili9325_queue_begin(ili9325);
+	ili9325_queue_write(ili9325, reg, val);
+
+	return ili9325_queue_end(ili9325);
+}
+
+static int ili9325_read(struct tinydrm_ili9325 *ili9325, u16 reg, u16 *val)
+{
+	int ret;
+
+	ili9325_queue_begin(ili9325);
+	ret = ili9325_queue_raw_read(ili9325, reg, val);
+	ili9325_queue_end(ili9325);
+
+	return ret;
+}
+
+/* Swap when the framebuffer byte order differs from the byte order sent */
+static bool ili9325_fb_swap(struct tinydrm_ili9325 *ili9325,
+			    struct drm_framebuffer *fb)
+{
+	return ili9325->swap_bytes != !!(fb->format->format & DRM_FORMAT_BIG_ENDIAN);
+}
+
+/* Caller must bracket this with tinydrm_fb_{begin,end}_cpu_access() */
+static int ili9325_rgb565_convert(void *dst, struct drm_framebuffer *fb,
+				  struct drm_rect *clip, bool swap)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+
+	return tinydrm_fb_convert_rgb565(dst, cma_obj->vaddr, fb, clip, swap);
+}
+
+static int ili9325_rgb565_buf_copy(void *dst, struct drm_framebuffer *fb,
+				   struct drm_rect *clip, bool swap)
+{
+	int ret, ret2;
+
+	ret = tinydrm_fb_begin_cpu_access(fb, clip);
+	if (ret)
+		return ret;
+
+	ret = ili9325_rgb565_convert(dst, fb, clip, swap);
+
+	ret2 = tinydrm_fb_end_cpu_access(fb, clip);
+
+	return ret ? ret : ret2;
+}
+
+/*
+ * A rect made of one repeated row, like a solid colour or a vertical gradient,
+ * is sent from a buffer holding as many converted rows as fit in a transfer.
+ * A solid colour fills the whole buffer. Returns the number of bytes to repeat,
+ * zero if the rect doesn't repeat or would need too many transfers.
+ */
+static size_t ili9325_fill_prepare(struct tinydrm_ili9325 *ili9325, struct drm_framebuffer *fb,
+				   struct drm_rect *rect, bool swap)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	size_t size = min_t(size_t, ILI9325_FILL_SIZE, ili9325->pixel_max_chunk);
+	unsigned int height = drm_rect_height(rect);
+	unsigned int width = drm_rect_width(rect);
+	size_t n, len, row_len = width * 2;
+	struct drm_rect row = *rect;
+	u16 *buf = ili9325->fill_buf;
+	unsigned int i;
+	bool repeat;
+
+	if (height < 2 || row_len > size)
+		return 0;
+
+	if (tinydrm_fb_begin_cpu_access(fb, rect))
+		return 0;
+
+	repeat = tinydrm_fb_rows_repeat(cma_obj->vaddr, fb, rect, ili9325->row_buf);
+	if (repeat) {
+		row.y2 = row.y1 + 1;
+		repeat = !ili9325_rgb565_convert(buf, fb, &row, swap);
+	}
+
+	tinydrm_fb_end_cpu_access(fb, rect);
+
+	if (!repeat)
+		return 0;
+
+	/* A solid colour can be cut on any pixel */
+	for (i = 1; i < width && buf[i] == buf[0]; i++)
+		;
+	if (i == width)
+		row_len = 2;
+
+	len = rounddown(size, row_len);
+	if (DIV_ROUND_UP(width * height * 2, len) > ili9325->pixel_num_xfers)
+		return 0;
+
+	for (n = row_len; n < len; n += min(n, len - n))
+		memcpy((void *)buf + n, buf, min(n, len - n));
+
+	return len;
+}
+
+/*
+ * Shadow mode: Convert @rect into the shadow and shrink it to what changed.
+ * Everything is sent when the display content is unknown, which is also the
+ * case after a failed flush. An asynchronous flush is only known to have
+ * failed when the next one waits for it, so it takes one more flush to
+ * repair.
+ */
+static int ili9325_shadow_diff(struct tinydrm_ili9325 *ili9325, struct drm_framebuffer *fb,
+			       struct drm_rect *rect, struct drm_rect *damage)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	int ret, ret2;
+
+	ret = tinydrm_fb_begin_cpu_access(fb, rect);
+	if (ret)
+		return ret;
+
+	ret = tinydrm_fb_convert_diff_rgb565(ili9325->shadow, cma_obj->vaddr, fb, rect,
+					     ili9325_fb_swap(ili9325, fb), damage,
+					     ili9325->diff_buf);
+
+	ret2 = tinydrm_fb_end_cpu_access(fb, rect);
+	if (ret || ret2)
+		return ret ? ret : ret2;
+
+	if (!ili9325->shadow_valid) {
+		*damage = *rect;
+		ili9325->shadow_valid = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Stream mode: Convert a band of rows into a bounce buffer and send it while
+ * the next band is converted. The band messages only carry the startbyte and
+ * pixel data, the controller keeps writing to GRAM since the index register
+ * still points to it. This ends the queue.
+ *
+ * With @latch set the page flip event is sent once the last band has been
+ * converted, stamped with the expected time for the bands still in flight.
+ */
+static int ili9325_queue_end_stream(struct tinydrm_ili9325 *ili9325,
+				    struct drm_framebuffer *fb,
+				    struct drm_rect *rect, bool latch)
+{
+	unsigned int rows = ili9325->band_size / (drm_rect_width(rect) * 2);
+	struct drm_rect clip = *rect;
+	size_t len, inflight = 0;
+	struct ili9325_band *band;
+	unsigned int i = 0;
+	int ret;
+
+	ili9325_queue_frame(ili9325, ili9325_get_startbyte(0, 0, 0), 0x0022);
+	ret = ili9325_queue_submit(ili9325);
+	if (ret)
+		goto out_unlock;
+
+	ret = tinydrm_fb_begin_cpu_access(fb, rect);
+	if (ret)
+		goto out_unlock;
+
+	for (; clip.y1 < rect->y2; clip.y1 = clip.y2) {
+		clip.y2 = min(clip.y1 + rows, rect->y2);
+		len = drm_rect_width(&clip) * drm_rect_height(&clip) * 2;
+
+		band = &ili9325->bands[i++ % ILI9325_NUM_BANDS];
+		ili9325_band_wait(ili9325, band);
+
+		ret = ili9325_rgb565_convert(band->buf, fb, &clip,
+					     ili9325_fb_swap(ili9325, fb));
+		if (ret)
+			break;
+
+		band->xfers[1].len = len;
+		band->xfers[1].bits_per_word = ili9325->pixel_bpw;
+		/* For reliability only run pixel data above spec */
+		band->xfers[1].speed_hz = len <= ili9325->slow_max_len ?
+			ili9325_norm_speed_hz(ili9325) : ili9325->pixel_speed_hz;
+
+		spi_message_init_with_transfers(&band->msg, band->xfers,
+						ARRAY_SIZE(band->xfers));
+		band->msg.complete = ili9325_band_complete;
+		band->msg.context = band;
+		reinit_completion(&band->done);
+
+		ret = spi_async(ili9325->spi, &band->msg);
+		if (ret)
+			break;
+
+		band->busy = true;
+	}
+
+	if (!ret)
+		ret = tinydrm_fb_end_cpu_access(fb, rect);
+	else
+		tinydrm_fb_end_cpu_access(fb, rect);
+
+	if (!ret && latch) {
+		for (i = 0; i < ILI9325_NUM_BANDS; i++) {
+			band = &ili9325->bands[i];
+			if (band->busy && !completion_done(&band->done))
+				inflight += band->xfers[1].len;
+		}
+		tinydrm_flush_latch(&ili9325->flush,
+				    div_u64((u64)inflight * ili9325->cost.byte_ps, 1000));
+	}
+out_unlock:
+	mutex_unlock(&ili9325->cmdlock);
+
+	return ret;
+}
+
+static void ili9325_cost_init(struct tinydrm_ili9325 *ili9325)
+{
+	struct ili9325_cost *cost = &ili9325->cost;
+
+	memset(cost, 0, sizeof(*cost));
+	cost->setup_ns = ILI9325_COST_SETUP_NS;
+	cost->byte_ps = div_u64(8ULL * NSEC_PER_SEC * 1000, ili9325->pixel_speed_hz);
+}
+
+static void ili9325_cost_sample(struct tinydrm_ili9325 *ili9325, size_t len, u64 ns)
+{
+	struct ili9325_cost *cost = &ili9325->cost;
+	u64 x = len, y = min_t(u64, ns, NSEC_PER_SEC);
+	s64 num, den, byte_ps, setup_ns;
+
+	cost->sum_w -= cost->sum_w / 8;
+	cost->sum_x -= cost->sum_x / 8;
+	cost->sum_y -= cost->sum_y / 8;
+	cost->sum_xx -= cost->sum_xx / 8;
+	cost->sum_xy -= cost->sum_xy / 8;
+
+	cost->sum_w += ILI9325_COST_WEIGHT;
+	cost->sum_x += ILI9325_COST_WEIGHT * x;
+	cost->sum_y += ILI9325_COST_WEIGHT * y;
+	cost->sum_xx += ILI9325_COST_WEIGHT * x * x;
+	cost->sum_xy += ILI9325_COST_WEIGHT * x * y;
+
+	/* Needs flushes of different sizes to tell setup from pixel time */
+	den = cost->sum_w * cost->sum_xx - cost->sum_x * cost->sum_x;
+	if (den < 1000 * 1000)
+		return;
+
+	num = cost->sum_w * cost->sum_xy - cost->sum_x * cost->sum_y;
+	if (num <= 0)
+		return;
+
+	byte_ps = div64_s64(num, div64_s64(den, 1000));
+	setup_ns = div64_s64(cost->sum_y - div64_s64(byte_ps * cost->sum_x, 1000),
+			     cost->sum_w);
+
+	cost->byte_ps = clamp_t(s64, byte_ps, 1, U32_MAX);
+	cost->setup_ns = clamp_t(s64, setup_ns, 0, U32_MAX);
+}
+
+/* In picoseconds */
+static u64 ili9325_cost_rect(struct tinydrm_ili9325 *ili9325, struct drm_rect *rect)
+{
+	u64 len = drm_rect_width(rect) * drm_rect_height(rect) * 2;
+
+	return ili9325->cost.setup_ns * 1000ULL + len * ili9325->cost.byte_ps;
+}
+
+/* Expected time to send @rect, from the flush cost model */
+static u64 ili9325_flush_time(struct tinydrm_ili9325 *ili9325, struct drm_rect *rect)
+{
+	return div_u64(ili9325_cost_rect(ili9325, rect), 1000);
+}
+
+/* Set the window to @rect and the address to its start */
+static void ili9325_queue_window(struct tinydrm_ili9325 *ili9325, struct drm_rect *rect)
+{
+	/* The window registers are only sent when they change */
+	switch (ili9325->set_win_type) {
+	case 0:
+		ili9325_queue_update(ili9325, 0x50, rect->x1);
+		ili9325_queue_update(ili9325, 0x51, rect->x2 - 1);
+		ili9325_queue_update(ili9325, 0x52, rect->y1);
+		ili9325_queue_update(ili9325, 0x53, rect->y2 - 1);
+		ili9325_queue_write(ili9325, 0x20, rect->x1);
+		ili9325_queue_write(ili9325, 0x21, rect->y1);
+		break;
+	case 1:
+		ili9325_queue_update(ili9325, 0x50, rect->y1);
+		ili9325_queue_update(ili9325, 0x51, rect->y2 - 1);
+		ili9325_queue_update(ili9325, 0x52, 319 - (rect->x2 - 1));
+		ili9325_queue_update(ili9325, 0x53, 319 - rect->x1);
+		ili9325_queue_write(ili9325, 0x20, rect->y1);
+		ili9325_queue_write(ili9325, 0x21, 319 - rect->x1);
+		break;
+	case 2:
+		ili9325_queue_update(ili9325, 0x50, 239 - (rect->x2 - 1));
+		ili9325_queue_update(ili9325, 0x51, 239 - rect->x1);
+		ili9325_queue_update(ili9325, 0x52, 319 - (rect->y2 - 1));
+		ili9325_queue_update(ili9325, 0x53, 319 - rect->y1);
+		ili9325_queue_write(ili9325, 0x20, 239 - rect->x1);
+		ili9325_queue_write(ili9325, 0x21, 319 - rect->y1);
+		break;
+	case 3:
+		ili9325_queue_update(ili9325, 0x50, 239 - (rect->y2 - 1));
+		ili9325_queue_update(ili9325, 0x51, 239 - rect->y1);
+		ili9325_queue_update(ili9325, 0x52, rect->x1);
+		ili9325_queue_update(ili9325, 0x53, rect->x2 - 1);
+		ili9325_queue_write(ili9325, 0x20, 239 - rect->y1);
+		ili9325_queue_write(ili9325, 0x21, rect->x1);
+		break;
+	};
+}
+
+static u16 ili9325_swap_rb(u16 val)
+{
+	return (val << 11) | (val & 0x07e0) | (val >> 11);
+}
+
+/*
+ * A pixel clock that is too fast for the wiring corrupts the data without the
+ * transfer failing, so the only way to tell is to read it back. Once a second
+ * the start of a synchronous flush is read back and compared with what was
+ * sent. This needs MISO like calibration.
+ */
+static void ili9325_verify(struct tinydrm_ili9325 *ili9325, struct drm_rect *rect,
+			   const u16 *buf)
+{
+	struct ili9325_cmdbuf *cmdbuf = &ili9325->cmdbuf;
+	unsigned int i, n = min_t(unsigned int, drm_rect_width(rect), ILI9325_VERIFY_PIXELS);
+	struct spi_transfer *tr;
+	int ret;
+
+	if (!ili9325->devcode || ili9325->pixel_speed_hz <= ili9325_norm_speed_hz(ili9325) ||
+	    time_before(jiffies, ili9325->verify_next))
+		return;
+
+	ili9325->verify_next = jiffies + HZ;
+
+	ili9325_queue_begin(ili9325);
+	ili9325_queue_window(ili9325, rect);
+	ili9325_queue_frame(ili9325, ili9325_get_startbyte(0, 0, 0), 0x0022);
+
+	/* Startbyte, dummy byte and dummy pixel like calibration */
+	tr = ili9325_queue_add(ili9325);
+	tr->tx_buf = cmdbuf->verify_tx;
+	tr->rx_buf = cmdbuf->verify_rx;
+	tr->speed_hz = min_t(u32, 5000000, ili9325->spi->max_speed_hz / 2);
+	tr->bits_per_word = 8;
+	tr->len = 4 + n * 2;
+
+	/* A failed read says nothing about the pixel clock */
+	ret = ili9325_queue_end(ili9325);
+	if (ret)
+		return;
+
+	for (i = 0; i < n; i++) {
+		u16 val = get_unaligned_be16(&cmdbuf->verify_rx[4 + i * 2]);
+		u16 sent = ili9325->swap_bytes ? swab16(buf[i]) : buf[i];
+
+		/* Reads can come back with red and blue swapped */
+		if (val != sent && val != ili9325_swap_rb(sent))
+			break;
+	}
+
+	if (i == n)
+		return;
+
+	dev_warn_ratelimited(&ili9325->spi->dev, "Pixel data read back wrong\n");
+	ili9325->shadow_valid = false;
+	ili9325_pixel_speed_backoff(ili9325);
+}
+
+/*
+ * With @latch set the page flip event is sent as soon as the framebuffer has
+ * been read, which for the copying paths is before the data is sent.
+ */
+static void ili9325_fb_dirty(struct drm_framebuffer *fb, struct drm_rect *rect, bool latch)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(fb->dev);
+	unsigned int height, width, y;
+	bool copy, contiguous, swap, sync;
+	struct drm_rect damage;
+	size_t fill_len = 0;
+	int idx, ret = 0;
+	ktime_t start;
+	void *tr;
+
+	if (!ili9325->enabled)
+		return;
+
+	if (!drm_dev_enter(fb->dev, &idx))
+		return;
+
+	start = ktime_get();
+
+	if (ili9325->shadow) {
+		ret = ili9325_shadow_diff(ili9325, fb, rect, &damage);
+		if (ret || !drm_rect_visible(&damage))
+			goto err_exit;
+		rect = &damage;
+		/* Sent from the shadow buffer */
+		if (latch)
+			tinydrm_flush_latch(&ili9325->flush, ili9325_flush_time(ili9325, rect));
+	}
+
+	height = drm_rect_height(rect);
+	width = drm_rect_width(rect);
+
+	DRM_DEBUG_KMS("Flushing [FB:%d] " DRM_RECT_FMT "\n", fb->base.id, DRM_RECT_ARG(rect));
+
+	if (ili9325->shadow) {
+		/* The next flush updates the shadow so async has to copy */
+		copy = async || width != fb->width;
+		tr = ili9325->shadow + rect->y1 * fb->width + rect->x1;
+		if (copy) {
+			for (y = 0; y < height; y++)
+				memcpy(ili9325->tx_buf[ili9325->tx_idx] + y * width * 2,
+				       tr + y * fb->width * 2, width * 2);
+			tr = ili9325->tx_buf[ili9325->tx_idx];
+		}
+	} else {
+		/* Full width rows without padding are contiguous in the framebuffer */
+		contiguous = width == fb->width &&
+			     fb->pitches[0] == width * fb->format->cpp[0];
+
+		swap = ili9325_fb_swap(ili9325, fb);
+		copy = swap || !contiguous || fb->format->format == DRM_FORMAT_XRGB8888;
+		tr = cma_obj->vaddr + fb->offsets[0] + rect->y1 * fb->pitches[0];
+		if (copy)
+			fill_len = ili9325_fill_prepare(ili9325, fb, rect, swap);
+		if (fill_len) {
+			/* Sent synchronously since the buffer is reused */
+			copy = false;
+			tr = ili9325->fill_buf;
+		} else if (copy && !ili9325->stream) {
+			/* In async mode the other buffer can still be in flight */
+			tr = ili9325->tx_buf[ili9325->tx_idx];
+			ret = ili9325_rgb565_buf_copy(tr, fb, rect, swap);
+			if (ret)
+				goto err_exit;
+		} else if (!copy) {
+			tinydrm_fb_sync_for_device(fb, rect);
+		}
+
+		/* Stream mode latches itself, sending straight from the framebuffer on return */
+		if (latch && (fill_len || (copy && !ili9325->stream)))
+			tinydrm_flush_latch(&ili9325->flush, ili9325_flush_time(ili9325, rect));
+	}
+
+	ili9325_queue_begin(ili9325);
+	ili9325_queue_window(ili9325, rect);
+
+	if (copy && ili9325->stream) {
+		ret = ili9325_queue_end_stream(ili9325, fb, rect, latch);
+		goto err_exit;
+	}
+
+	if (fill_len)
+		ili9325_queue_writebuf_repeat(ili9325, 0x0022, tr, fill_len,
+					      width * height * 2);
+	else
+		ili9325_queue_writebuf(ili9325, 0x0022, tr, width * height * 2);
+
+	/* The framebuffer can go away when we return so only async send copies */
+	sync = !(async && copy);
+	if (!sync) {
+		ret = ili9325_queue_end_async(ili9325);
+		ili9325->tx_idx ^= 1;
+	} else {
+		ret = ili9325_queue_end(ili9325);
+	}
+
+	/*
+	 * Only synchronous flushes tell how long the whole flush takes. In shadow
+	 * mode the time also depends on the damage before diffing and fills skip
+	 * most of the conversion.
+	 */
+	if (sync && !ret && !ili9325->shadow && !fill_len)
+		ili9325_cost_sample(ili9325, width * height * 2,
+				    ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	if (sync && !ret)
+		ili9325_verify(ili9325, rect, tr);
+
+err_exit:
+	drm_dev_exit(idx);
+	if (ret) {
+		dev_err_once(fb->dev->dev, "Failed to update display %d\n", ret);
+		/* The shadow has content the display didn't get */
+		ili9325->shadow_valid = false;
+	}
+}
+
+static void ili9325_reset(struct tinydrm_ili9325 *ili9325)
+{
+	/* Also after power on without a reset line, the cache starts out zeroed */
+	bitmap_zero(ili9325->reg_written, 0x100);
+
+	if (!ili9325->reset)
+		return;
+
+	gpiod_set_value_cansleep(ili9325->reset, 0);
+	msleep(1);
+	gpiod_set_value_cansleep(ili9325->reset, 1);
+	msleep(10);
+}
+
+/* Every bit set and cleared, in the colour fields and across them */
+static const u16 ili9325_cal_patterns[] = {
+	0xffff, 0x0000, 0xa815, 0x57ea, 0xf81f, 0x07e0, 0x5000, 0x000a,
+};
+
+#define ILI9325_CAL_LEN		(240 * 8 * 2)
+
+/*
+ * Write the test pixels to GRAM at @speed_hz and read them back at the
+ * register read speed. GRAM reads have the dummy byte like register reads
+ * followed by a dummy pixel.
+ */
+static int ili9325_calibrate_speed(struct tinydrm_ili9325 *ili9325, u32 speed_hz,
+				   const u16 *pixels, u8 *tx, u8 *rx, size_t len)
+{
+	struct spi_device *spi = ili9325->spi;
+	struct spi_transfer *tr;
+	unsigned int i;
+	int ret;
+
+	ili9325_queue_begin(ili9325);
+
+	ili9325_queue_update(ili9325, 0x50, 0);
+	ili9325_queue_update(ili9325, 0x51, 239);
+	ili9325_queue_update(ili9325, 0x52, 0);
+	ili9325_queue_update(ili9325, 0x53, 319);
+	ili9325_queue_write(ili9325, 0x20, 0);
+	ili9325_queue_write(ili9325, 0x21, 0);
+
+	ili9325->pixel_speed_hz = speed_hz;
+	ili9325_queue_writebuf(ili9325, 0x0022, pixels, len);
+	ili9325_queue_flush(ili9325);
+
+	ili9325_queue_write(ili9325, 0x20, 0);
+	ili9325_queue_write(ili9325, 0x21, 0);
+	ili9325_queue_frame(ili9325, ili9325_get_startbyte(0, 0, 0), 0x0022);
+
+	tr = ili9325_queue_add(ili9325);
+	tr->tx_buf = tx;
+	tr->rx_buf = rx;
+	tr->speed_hz = min_t(u32, 5000000, spi->max_speed_hz / 2);
+	tr->bits_per_word = 8;
+	tr->len = len + 4;
+
+	ret = ili9325_queue_end(ili9325);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < len / 2; i++) {
+		u16 sent = ili9325_cal_patterns[i % ARRAY_SIZE(ili9325_cal_patterns)];
+		u16 val = get_unaligned_be16(&rx[4 + i * 2]);
+
+		/* Reads can come back with red and blue swapped, see ili9325_verify() */
+		if (val != sent && val != ili9325_swap_rb(sent))
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the fastest pixel clock that GRAM reads back correctly at, starting
+ * at the register clock and going up in 25% steps. This needs MISO and runs
+ * once after the first init while the backlight is still off.
+ */
+static void ili9325_calibrate(struct tinydrm_ili9325 *ili9325)
+{
+	struct device *dev = &ili9325->spi->dev;
+	u32 speed, best = 0, max_speed = calibrate * 1000000;
+	size_t len = ILI9325_CAL_LEN;
+	u8 *tx, *rx;
+	u16 *pixels;
+	unsigned int i;
+
+	if (!calibrate || ili9325->calibrated || !ili9325->devcode ||
+	    max_speed < ili9325_norm_speed_hz(ili9325))
+		return;
+
+	ili9325->calibrated = true;
+
+	/* The read is one transfer */
+	len = min(len, round_down(ili9325->pixel_max_chunk - 4, 2));
+
+	pixels = kmalloc(len, GFP_KERNEL);
+	tx = kzalloc(len + 4, GFP_KERNEL);
+	rx = kmalloc(len + 4, GFP_KERNEL);
+	if (!pixels || !tx || !rx)
+		goto out_free;
+
+	for (i = 0; i < len / 2; i++) {
+		u16 val = ili9325_cal_patterns[i % ARRAY_SIZE(ili9325_cal_patterns)];
+
+		pixels[i] = ili9325->swap_bytes ? swab16(val) : val;
+	}
+	tx[0] = ili9325_get_startbyte(0, 1, true);
+
+	for (speed = ili9325_norm_speed_hz(ili9325); speed <= max_speed; speed += speed / 4) {
+		if (ili9325_calibrate_speed(ili9325, speed, pixels, tx, rx, len))
+			break;
+		best = speed;
+	}
+
+	if (best) {
+		dev_info(dev, "Pixel clock calibrated to %u kHz\n", best / 1000);
+		ili9325->pixel_speed_hz = best;
+	} else {
+		dev_warn(dev, "GRAM readback failed, calibration is not possible\n");
+		ili9325->pixel_speed_hz = ili9325->spi->max_speed_hz;
+	}
+	schedule_work(&ili9325->mode_work);
+
+out_free:
+	kfree(rx);
+	kfree(tx);
+	kfree(pixels);
+}
+
+/* Time sending pixel data @count times, returns U64_MAX on error */
+static u64 ili9325_tune_time(struct tinydrm_ili9325 *ili9325, const void *buf,
+			     size_t len, unsigned int count)
+{
+	u64 ns, best = U64_MAX;
+	unsigned int run, i;
+	ktime_t start;
+
+	for (run = 0; run < ILI9325_TUNE_RUNS; run++) {
+		start = ktime_get();
+		for (i = 0; i < count; i++) {
+			ili9325_queue_begin(ili9325);
+			ili9325_queue_writebuf(ili9325, 0x0022, buf, len);
+			if (ili9325_queue_end(ili9325))
+				return U64_MAX;
+		}
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		best = min(best, ns);
+	}
+
+	return best;
+}
+
+/*
+ * Time the conversion that byte swaps a 320 pixel wide RGB565 framebuffer,
+ * the same path that fb_dirty takes when the byte order doesn't match.
+ */
+static u64 ili9325_tune_swap_time(void *dst, void *src, size_t len)
+{
+	struct drm_framebuffer fb = {
+		.format = drm_format_info(DRM_FORMAT_RGB565),
+		.width = 320,
+		.height = len / (320 * 2),
+		.pitches = { 320 * 2 },
+	};
+	struct drm_rect clip;
+	u64 ns, best = U64_MAX;
+	unsigned int run;
+	ktime_t start;
+
+	drm_rect_init(&clip, 0, 0, fb.width, fb.height);
+
+	for (run = 0; run < ILI9325_TUNE_RUNS; run++) {
+		start = ktime_get();
+		tinydrm_fb_convert_rgb565(dst, src, &fb, &clip, true);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		best = min(best, ns);
+	}
+
+	return best;
+}
+
+/* Index of the fastest result or -1 if none was run */
+static int ili9325_tune_fastest(const u64 *ns, unsigned int num)
+{
+	int i, best = -1;
+
+	for (i = 0; i < num; i++) {
+		if (ns[i] && (best < 0 || ns[i] < ns[best]))
+			best = i;
+	}
+
+	return best;
+}
+
+/*
+ * Time the transport strategies on the actual SPI controller and keep the
+ * fastest: 16 or 8 bits per word, the chunk size for pixel data and up to which
+ * length small writes can stay at the register clock without being slower.
+ *
+ * The format order is fixed when the plane is registered, so the word size
+ * that doesn't send the preferred format as is gets charged for the byte swap.
+ * This keeps a rerun from debugfs consistent with what userspace picked.
+ *
+ * This needs an initialized panel and the stream mode bands, so it runs on
+ * first enable. Chunks are never smaller than a band.
+ */
+static void ili9325_autotune(struct tinydrm_ili9325 *ili9325)
+{
+	struct ili9325_tune *tune = &ili9325->tune;
+	size_t chunk, max_chunk = ili9325_max_chunk(ili9325);
+	struct spi_device *spi = ili9325->spi;
+	u32 preferred = ili9325->pipe.plane.format_types[0];
+	size_t len = ILI9325_TUNE_LEN;
+	void *buf, *conv;
+	unsigned int i;
+	int best;
+
+	buf = kzalloc(len, GFP_KERNEL);
+	conv = kmalloc(len, GFP_KERNEL);
+	if (!buf || !conv)
+		goto out_free;
+
+	ili9325->tuned = true;
+
+	memset(tune, 0, sizeof(*tune));
+	ili9325->pixel_max_chunk = max_chunk;
 
-	startbyte = ili9325_get_startbyte(0, 1, 0);
-	return ili9325_spi_transfer(ili9325, startbyte, buf, len);
-}
+	for (i = 0; i < ARRAY_SIZE(tune->bpw_ns); i++) {
+		u8 bpw = i ? 8 : 16;
 
-static int ili9325_write(struct tinydrm_ili9325 *ili9325, u16 reg, u16 val)
-{
-	u16 *buf;
-	int ret;
+		if (!spi_is_bpw_supported(spi, bpw))
+			continue;
 
-	buf = kmalloc(sizeof(*buf), GFP_KERNEL);
-	if (!buf)
-		return -ENOMEM;
+		ili9325_set_bpw(ili9325, bpw);
+		tune->bpw_ns[i] = ili9325_tune_time(ili9325, buf, len, 1);
+		if (ili9325->swap_bytes != !!(preferred & DRM_FORMAT_BIG_ENDIAN) &&
+		    tune->bpw_ns[i] != U64_MAX)
+			tune->bpw_ns[i] += ili9325_tune_swap_time(conv, buf, len);
+	}
 
-	if (ili9325->swap_bytes)
-		*buf = swab16(val);
-	else
-		*buf = val;
+	best = ili9325_tune_fastest(tune->bpw_ns, ARRAY_SIZE(tune->bpw_ns));
+	if (best < 0)
+		best = !spi_is_bpw_supported(spi, 16);
+	ili9325_set_bpw(ili9325, best ? 8 : 16);
 
-	ret = ili9325_writebuf(ili9325, reg, buf, sizeof(*buf));
-	kfree(buf);
+	for (i = 0; i < ARRAY_SIZE(ili9325_tune_chunks); i++) {
+		chunk = min(max_chunk, ili9325_tune_chunks[i]);
+		if (chunk < ili9325->band_size ||
+		    (i && chunk == min(max_chunk, ili9325_tune_chunks[i - 1])))
+			continue;
 
-	return ret;
-}
+		ili9325->pixel_max_chunk = chunk;
+		tune->chunk_ns[i] = ili9325_tune_time(ili9325, buf, len, 1);
+	}
 
-static int ili9325_read(struct tinydrm_ili9325 *ili9325, u16 reg, u16 *val)
-{
-	struct spi_device *spi = ili9325->spi;
-	u32 speed_hz = min_t(u32, 5000000, spi->max_speed_hz / 2);
-	struct spi_transfer header = {
-		.speed_hz = speed_hz,
-		.bits_per_word = 8,
-		.len = 1,
-	};
-	struct spi_transfer trrx = {
-		.speed_hz = speed_hz,
-		.bits_per_word = 8,
-		.len = 3, /* including dummy byte */
-	};
-	struct spi_message m;
-	u8 *startbytebuf;
-	int ret;
+	best = ili9325_tune_fastest(tune->chunk_ns, ARRAY_SIZE(tune->chunk_ns));
+	ili9325->pixel_max_chunk = best < 0 ? max_chunk :
+				   min(max_chunk, ili9325_tune_chunks[best]);
+
+	for (i = 0; i < ARRAY_SIZE(ili9325_tune_small); i++) {
+		ili9325->slow_max_len = ili9325_tune_small[i];
+		tune->slow_ns[i] = ili9325_tune_time(ili9325, buf, ili9325_tune_small[i],
+						     ILI9325_TUNE_SMALL_COUNT);
+		ili9325->slow_max_len = 0;
+		tune->fast_ns[i] = ili9325_tune_time(ili9325, buf, ili9325_tune_small[i],
+						     ILI9325_TUNE_SMALL_COUNT);
+	}
 
-	startbytebuf = kmalloc(header.len, GFP_KERNEL);
-	trrx.rx_buf = kzalloc(trrx.len, GFP_KERNEL);
-	if (!startbytebuf || !trrx.rx_buf) {
-		ret = -ENOMEM;
-		goto err_free;
+	/* Prefer the register clock unless it's more than 5% slower */
+	for (i = 0; i < ARRAY_SIZE(ili9325_tune_small); i++) {
+		if (tune->slow_ns[i] > tune->fast_ns[i] + tune->fast_ns[i] / 20)
+			break;
+		ili9325->slow_max_len = ili9325_tune_small[i];
 	}
 
-	ret = ili9325_write_index(ili9325, reg);
-	if (ret)
-		goto err_free;
+	DRM_DEBUG_DRIVER("bpw=%u max_chunk=%zu slow_max_len=%zu\n", ili9325->pixel_bpw,
+			 ili9325->pixel_max_chunk, ili9325->slow_max_len);
 
-	header.tx_buf = startbytebuf;
-	*startbytebuf = ili9325_get_startbyte(0, 1, true);
-	spi_message_init(&m);
-	spi_message_add_tail(&header, &m);
-	spi_message_add_tail(&trrx, &m);
-	ret = spi_sync(spi, &m);
-	if (ret)
-		goto err_free;
+out_free:
+	kfree(conv);
+	kfree(buf);
+}
 
-	/* throw away dummy byte */
-	*val = get_unaligned_be16(trrx.rx_buf + 1);
+/*
+ * Turn off the display and put the controller in sleep mode. GRAM and the
+ * registers are retained, and since the writes bypass the register cache it
+ * still holds the values needed to wake up again.
+ */
+static void ili9325_sleep(struct tinydrm_ili9325 *ili9325)
+{
+	int ret;
 
-err_free:
-	kfree(startbytebuf);
-	kfree(trrx.rx_buf);
+	ili9325_queue_begin(ili9325);
+	ili9325_queue_raw_write(ili9325, 0x07, 0x0000);	/* Display Control */
+	ili9325_queue_raw_write(ili9325, 0x10, BIT(1));	/* Power Control 1: SLP */
+	ret = ili9325_queue_end(ili9325);
 
-	return ret;
+	ili9325->asleep = !ret;
 }
 
-static int ili9325_rgb565_buf_copy(void *dst, struct drm_framebuffer *fb,
-				   struct drm_rect *clip, bool swap)
+/*
+ * Wake the controller up by restoring the power and display control
+ * registers from the cache. Returns an error if a full reset and
+ * initialization is needed.
+ */
+static int ili9325_wake(struct tinydrm_ili9325 *ili9325)
 {
-	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
-	struct dma_buf_attachment *import_attach = cma_obj->base.import_attach;
-	void *src = cma_obj->vaddr;
-	int ret = 0;
+	unsigned int entry_mode;
+	u16 val;
+	int ret;
 
-	if (import_attach) {
-		ret = dma_buf_begin_cpu_access(import_attach->dmabuf,
-					       DMA_FROM_DEVICE);
-		if (ret)
+	if (!ili9325->asleep)
+		return -ENODEV;
+
+	ili9325->asleep = false;
+
+	ili9325_queue_begin(ili9325);
+
+	/* Make sure the controller hasn't lost power while sleeping */
+	if (ili9325->devcode) {
+		regmap_read(ili9325->regmap, 0x03, &entry_mode);
+		ret = ili9325_queue_raw_read(ili9325, 0x03, &val);
+		if (!ret && val != entry_mode)
+			ret = -ENODEV;
+		if (ret) {
+			ili9325_queue_end(ili9325);
 			return ret;
+		}
 	}
 
-	switch (fb->format->format) {
-	case DRM_FORMAT_RGB565:
-		if (swap)
-			drm_fb_swab16(dst, src, fb, clip);
-		else
-			drm_fb_memcpy(dst, src, fb, clip);
-		break;
-	case DRM_FORMAT_XRGB8888:
-		drm_fb_xrgb8888_to_rgb565(dst, src, fb, clip, swap);
-		break;
-	default:
-		return -EINVAL;
+	regcache_mark_dirty(ili9325->regmap);
+	/* Power Control 1-4 */
+	ili9325_queue_set_error(ili9325, regcache_sync_region(ili9325->regmap, 0x10, 0x13));
+	if (!ili9325_queue_flush(ili9325)) {
+		/* Let the power supply settle */
+		msleep(50);
+		/* Display Control */
+		ili9325_queue_set_error(ili9325, regcache_sync_region(ili9325->regmap, 0x07, 0x07));
 	}
 
-	if (import_attach)
-		ret = dma_buf_end_cpu_access(import_attach->dmabuf,
-					     DMA_FROM_DEVICE);
-	return ret;
+	return ili9325_queue_end(ili9325);
 }
 
-static void ili9325_fb_dirty(struct drm_framebuffer *fb, struct drm_rect *rect)
+static void ili9325_pipe_disable(struct drm_simple_display_pipe *pipe)
 {
-	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
-	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(fb->dev);
-	unsigned int height = drm_rect_height(rect);
-	unsigned int width = drm_rect_width(rect);
-	int idx, ret = 0;
-	bool full;
-	void *tr;
-
-	if (!ili9325->enabled)
-		return;
+	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(pipe->crtc.dev);
+	int idx;
 
-	if (!drm_dev_enter(fb->dev, &idx))
-		return;
+	drm_crtc_vblank_off(&pipe->crtc);
+	tinydrm_flush_stop(&ili9325->flush);
+	ili9325->enabled = false;
+	ili9325_queue_sync(ili9325);
+	backlight_disable(ili9325->backlight);
 
-	full = width == fb->width && height == fb->height;
+	if (drm_dev_enter(pipe->crtc.dev, &idx)) {
+		ili9325_sleep(ili9325);
+		drm_dev_exit(idx);
+	}
+}
 
-	DRM_DEBUG_KMS("Flushing [FB:%d] " DRM_RECT_FMT "\n", fb->base.id, DRM_RECT_ARG(rect));
+static void ili9325_flush(struct tinydrm_flush *flush, struct drm_framebuffer *fb,
+			  struct drm_rect *clips, unsigned int num_clips)
+{
+	struct tinydrm_ili9325 *ili9325 = container_of(flush, struct tinydrm_ili9325, flush);
+	struct drm_rect merged = clips[0];
+	u64 split_cost = 0;
+	unsigned int i;
+
+	for (i = 0; i < num_clips; i++) {
+		merged.x1 = min(merged.x1, clips[i].x1);
+		merged.y1 = min(merged.y1, clips[i].y1);
+		merged.x2 = max(merged.x2, clips[i].x2);
+		merged.y2 = max(merged.y2, clips[i].y2);
+		split_cost += ili9325_cost_rect(ili9325, &clips[i]);
+	}
 
-	if (ili9325->swap_bytes || !full || fb->format->format == DRM_FORMAT_XRGB8888) {
-		tr = ili9325->tx_buf;
-		ret = ili9325_rgb565_buf_copy(tr, fb, rect, ili9325->swap_bytes);
-		if (ret)
-			goto err_exit;
+	/* Separate windows pay the setup cost each, merged sends the gaps */
+	if (num_clips > 1 && split_cost < ili9325_cost_rect(ili9325, &merged)) {
+		for (i = 0; i < num_clips; i++)
+			ili9325_fb_dirty(fb, &clips[i], i == num_clips - 1);
 	} else {
-		tr = cma_obj->vaddr;
+		ili9325_fb_dirty(fb, &merged, true);
 	}
-
-	switch (ili9325->set_win_type) {
-	case 0:
-		ili9325_write(ili9325, 0x50, rect->x1);
-		ili9325_write(ili9325, 0x51, rect->x2 - 1);
-		ili9325_write(ili9325, 0x52, rect->y1);
-		ili9325_write(ili9325, 0x53, rect->y2 - 1);
-		ili9325_write(ili9325, 0x20, rect->x1);
-		ili9325_write(ili9325, 0x21, rect->y1);
-		break;
-	case 1:
-		ili9325_write(ili9325, 0x50, rect->y1);
-		ili9325_write(ili9325, 0x51, rect->y2 - 1);
-		ili9325_write(ili9325, 0x52, 319 - (rect->x2 - 1));
-		ili9325_write(ili9325, 0x53, 319 - rect->x1);
-		ili9325_write(ili9325, 0x20, rect->y1);
-		ili9325_write(ili9325, 0x21, 319 - rect->x1);
-		break;
-	case 2:
-		ili9325_write(ili9325, 0x50, 239 - (rect->x2 - 1));
-		ili9325_write(ili9325, 0x51, 239 - rect->x1);
-		ili9325_write(ili9325, 0x52, 319 - (rect->y2 - 1));
-		ili9325_write(ili9325, 0x53, 319 - rect->y1);
-		ili9325_write(ili9325, 0x20, 239 - rect->x1);
-		ili9325_write(ili9325, 0x21, 319 - rect->y1);
-		break;
-	case 3:
-		ili9325_write(ili9325, 0x50, 239 - (rect->y2 - 1));
-		ili9325_write(ili9325, 0x51, 239 - rect->y1);
-		ili9325_write(ili9325, 0x52, rect->x1);
-		ili9325_write(ili9325, 0x53, rect->x2 - 1);
-		ili9325_write(ili9325, 0x20, 239 - rect->y1);
-		ili9325_write(ili9325, 0x21, rect->x1);
-		break;
-	};
-
-	ret = ili9325_writebuf(ili9325, 0x0022, tr, width * height * 2);
-
-err_exit:
-	drm_dev_exit(idx);
-	if (ret)
-		dev_err_once(fb->dev->dev, "Failed to update display %d\n", ret);
 }
 
-static void ili9325_reset(struct tinydrm_ili9325 *ili9325)
+static void ili9325_pipe_update(struct drm_simple_display_pipe *pipe,
+				struct drm_plane_state *old_state)
 {
-	if (!ili9325->reset)
-		return;
+	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(pipe->crtc.dev);
 
-	gpiod_set_value_cansleep(ili9325->reset, 0);
-	msleep(1);
-	gpiod_set_value_cansleep(ili9325->reset, 1);
-	msleep(10);
+	tinydrm_flush_queue(&ili9325->flush, old_state, pipe->plane.state);
 }
 
-static void ili9325_pipe_disable(struct drm_simple_display_pipe *pipe)
+static int ili9325_enable_vblank(struct drm_simple_display_pipe *pipe)
 {
 	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(pipe->crtc.dev);
 
-	ili9325->enabled = false;
-	backlight_disable(ili9325->backlight);
+	return tinydrm_flush_enable_vblank(&ili9325->flush);
 }
 
-static void ili9325_pipe_update(struct drm_simple_display_pipe *pipe,
-				struct drm_plane_state *old_state)
+static void ili9325_disable_vblank(struct drm_simple_display_pipe *pipe)
 {
-	struct drm_plane_state *state = pipe->plane.state;
-	struct drm_crtc *crtc = &pipe->crtc;
-	struct drm_rect rect;
-
-	if (drm_atomic_helper_damage_merged(old_state, state, &rect))
-		ili9325_fb_dirty(state->fb, &rect);
+	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(pipe->crtc.dev);
 
-	/* DRM core handles this in Linux 5.7 */
-	if (crtc->state->event) {
-		spin_lock_irq(&crtc->dev->event_lock);
-		drm_crtc_send_vblank_event(crtc, crtc->state->event);
-		spin_unlock_irq(&crtc->dev->event_lock);
-		crtc->state->event = NULL;
-	}
+	tinydrm_flush_disable_vblank(&ili9325->flush);
 }
 
 static void ili9325_enable_flush(struct tinydrm_ili9325 *ili9325,
 				 struct drm_plane_state *plane_state)
 {
-	struct drm_framebuffer *fb = plane_state->fb;
-	struct drm_rect rect = {
-		.x1 = 0,
-		.x2 = fb->width,
-		.y1 = 0,
-		.y2 = fb->height,
-	};
-
 	ili9325->enabled = true;
-	ili9325_fb_dirty(fb, &rect);
+	/* The display content is unknown after power up */
+	ili9325->shadow_valid = false;
+	tinydrm_flush_start(&ili9325->flush, plane_state->fb);
 	backlight_enable(ili9325->backlight);
+	drm_crtc_vblank_on(&ili9325->pipe.crtc);
 }
 
+/* Initialization sequence from HY28A example code */
+static const u8 hy28a_init_seq[] = {
+
+	ILI9325_SEQ_WRITE(0x00, 0x0000),
+
+	ILI9325_SEQ_WRITE(0x01, 0x0100),	/* Driver Output Control */
+	ILI9325_SEQ_WRITE(0x02, 0x0700),	/* LCD Driver Waveform Control */
+	ILI9325_SEQ_WRITE(0x03, 0x1038),	/* Set the scan mode */
+	ILI9325_SEQ_WRITE(0x04, 0x0000),	/* Scalling Control */
+	ILI9325_SEQ_WRITE(0x08, 0x0202),	/* Display Control 2 */
+	ILI9325_SEQ_WRITE(0x09, 0x0000),	/* Display Control 3 */
+	ILI9325_SEQ_WRITE(0x0a, 0x0000),	/* Frame Cycle Contal */
+	ILI9325_SEQ_WRITE(0x0c, BIT(0)),	/* Extern Display Interface Control 1 */
+	ILI9325_SEQ_WRITE(0x0d, 0x0000),	/* Frame Maker Position */
+	ILI9325_SEQ_WRITE(0x0f, 0x0000),	/* Extern Display Interface Control 2 */
+	ILI9325_SEQ_DELAY(50),
+	ILI9325_SEQ_WRITE(0x07, 0x0101),	/* Display Control */
+	ILI9325_SEQ_DELAY(50),
+	ILI9325_SEQ_WRITE(0x10, BIT(12) | BIT(7) | BIT(6)), /* Power Control 1 */
+	ILI9325_SEQ_WRITE(0x11, 0x0007),	/* Power Control 2 */
+	ILI9325_SEQ_WRITE(0x12, BIT(8) | BIT(4)),	/* Power Control 3 */
+	ILI9325_SEQ_WRITE(0x13, 0x0b00),	/* Power Control 4 */
+	ILI9325_SEQ_WRITE(0x29, 0x0000),	/* Power Control 7 */
+	ILI9325_SEQ_WRITE(0x2b, BIT(14) | BIT(4)),
+
+	ILI9325_SEQ_WRITE(0x50, 0),	/* Set X Start */
+	ILI9325_SEQ_WRITE(0x51, 239),	/* Set X End */
+	ILI9325_SEQ_WRITE(0x52, 0),	/* Set Y Start */
+	ILI9325_SEQ_WRITE(0x53, 319),	/* Set Y End */
+	ILI9325_SEQ_DELAY(50),
+
+	ILI9325_SEQ_WRITE(0x60, 0x2700),	/* Driver Output Control */
+	ILI9325_SEQ_WRITE(0x61, 0x0001),	/* Driver Output Control */
+	ILI9325_SEQ_WRITE(0x6a, 0x0000),	/* Vertical Srcoll Control */
+
+	ILI9325_SEQ_WRITE(0x80, 0x0000),	/* Display Position? Partial Display 1 */
+	ILI9325_SEQ_WRITE(0x81, 0x0000),	/* RAM Address Start? Partial Display 1 */
+	ILI9325_SEQ_WRITE(0x82, 0x0000),	/* RAM Address End-Partial Display 1 */
+	ILI9325_SEQ_WRITE(0x83, 0x0000),	/* Displsy Position? Partial Display 2 */
+	ILI9325_SEQ_WRITE(0x84, 0x0000),	/* RAM Address Start? Partial Display 2 */
+	ILI9325_SEQ_WRITE(0x85, 0x0000),	/* RAM Address End? Partial Display 2 */
+
+	ILI9325_SEQ_WRITE(0x90, 16), /* Frame Cycle Control */
+	ILI9325_SEQ_WRITE(0x92, 0x0000),	/* Panel Interface Control 2 */
+	ILI9325_SEQ_WRITE(0x93, 0x0001),	/* Panel Interface Control 3 */
+	ILI9325_SEQ_WRITE(0x95, 0x0110),	/* Frame Cycle Control */
+	ILI9325_SEQ_WRITE(0x97, 0),
+	ILI9325_SEQ_WRITE(0x98, 0x0000),	/* Frame Cycle Control */
+};
+
+/*
+ * Initialization sequence from HY28B example code
+ *
+ * FIXME:
+ * Apparently there are 2 versions of this display:
+ * https://github.com/raspberrypi/linux/pull/2721
+ *
+ * The ILI9325D has the same ID code (0x9325) as the ILI9325, so it can't be detected at runtime.
+ * Maybe the OTP registers are programmed?
+ * SPI reading is controlled by register R66h on ILI9325D.
+ * Until then the ILI9325D sequence can be loaded as firmware using the
+ * 'firmware-name' property.
+ */
+static const u8 hy28b_init_seq[] = {
+
+	ILI9325_SEQ_WRITE(0x00e7, 0x0010),
+
+	ILI9325_SEQ_WRITE(0x0000, 0x0001),
+	ILI9325_SEQ_WRITE(0x0001, 0x0100),
+	ILI9325_SEQ_WRITE(0x0002, 0x0700),
+	ILI9325_SEQ_WRITE(0x0003, BIT(12) | BIT(5) | BIT(4)),
+	ILI9325_SEQ_WRITE(0x0004, 0x0000),
+	ILI9325_SEQ_WRITE(0x0008, 0x0207),
+	ILI9325_SEQ_WRITE(0x0009, 0x0000),
+	ILI9325_SEQ_WRITE(0x000a, 0x0000),
+	ILI9325_SEQ_WRITE(0x000c, 0x0001),
+	ILI9325_SEQ_WRITE(0x000d, 0x0000),
+	ILI9325_SEQ_WRITE(0x000f, 0x0000),
+
+	/* Power On sequence */
+	ILI9325_SEQ_WRITE(0x0010, 0x0000),
+	ILI9325_SEQ_WRITE(0x0011, 0x0007),
+	ILI9325_SEQ_WRITE(0x0012, 0x0000),
+	ILI9325_SEQ_WRITE(0x0013, 0x0000),
+	ILI9325_SEQ_DELAY(50),
+
+	ILI9325_SEQ_WRITE(0x0010, 0x1590),
+	ILI9325_SEQ_WRITE(0x0011, 0x0227),
+	ILI9325_SEQ_DELAY(50),
+
+	ILI9325_SEQ_WRITE(0x0012, 0x009c),
+	ILI9325_SEQ_DELAY(50),
+
+	ILI9325_SEQ_WRITE(0x0013, 0x1900),
+	ILI9325_SEQ_WRITE(0x0029, 0x0023),
+	ILI9325_SEQ_WRITE(0x002b, 0x000e),
+	ILI9325_SEQ_DELAY(50),
+
+	ILI9325_SEQ_WRITE(0x0020, 0x0000),
+	ILI9325_SEQ_WRITE(0x0021, 0x0000),
+	ILI9325_SEQ_DELAY(50),
+
+	ILI9325_SEQ_WRITE(0x0030, 0x0007),
+	ILI9325_SEQ_WRITE(0x0031, 0x0707),
+	ILI9325_SEQ_WRITE(0x0032, 0x0006),
+	ILI9325_SEQ_WRITE(0x0035, 0x0704),
+	ILI9325_SEQ_WRITE(0x0036, 0x1f04),
+	ILI9325_SEQ_WRITE(0x0037, 0x0004),
+	ILI9325_SEQ_WRITE(0x0038, 0x0000),
+	ILI9325_SEQ_WRITE(0x0039, 0x0706),
+	ILI9325_SEQ_WRITE(0x003c, 0x0701),
+	ILI9325_SEQ_WRITE(0x003d, 0x000f),
+	ILI9325_SEQ_DELAY(50),
+
+	ILI9325_SEQ_WRITE(0x0050, 0),
+	ILI9325_SEQ_WRITE(0x0051, 239),
+	ILI9325_SEQ_WRITE(0x0052, 0),
+	ILI9325_SEQ_WRITE(0x0053, 319),
+
+	ILI9325_SEQ_WRITE(0x0060, 0xa700),
+	ILI9325_SEQ_WRITE(0x0061, 0x0001),
+	ILI9325_SEQ_WRITE(0x006a, 0x0000),
+
+	ILI9325_SEQ_WRITE(0x0080, 0x0000),
+	ILI9325_SEQ_WRITE(0x0081, 0x0000),
+	ILI9325_SEQ_WRITE(0x0082, 0x0000),
+	ILI9325_SEQ_WRITE(0x0083, 0x0000),
+	ILI9325_SEQ_WRITE(0x0084, 0x0000),
+	ILI9325_SEQ_WRITE(0x0085, 0x0000),
+
+	ILI9325_SEQ_WRITE(0x0090, 0x0010),
+	ILI9325_SEQ_WRITE(0x0092, 0x0000),
+	ILI9325_SEQ_WRITE(0x0093, 0x0003),
+	ILI9325_SEQ_WRITE(0x0095, 0x0110),
+	ILI9325_SEQ_WRITE(0x0097, 0x0000),
+	ILI9325_SEQ_WRITE(0x0098, 0x0000),
+};
+
 /* Uses an ILI9320 controller */
 static void hy28a_pipe_enable(struct drm_simple_display_pipe *pipe,
 			      struct drm_crtc_state *crtc_state,
@@ -400,82 +1857,47 @@ static void hy28a_pipe_enable(struct drm_simple_display_pipe *pipe,
 	if (!drm_dev_enter(pipe->crtc.dev, &idx))
 		return;
 
-	ili9325_reset(ili9325);
-
-	/* Initialization sequence from HY28A example code */
+	if (!ili9325_wake(ili9325))
+		goto out_flush;
 
-	ret = ili9325_write(ili9325, 0x00, 0x0000);
-	if (ret) {
-		dev_err(dev, "Failed to write register\n");
-		goto out_exit;
-	}
+	ili9325_reset(ili9325);
 
-	ili9325_write(ili9325, 0x01, 0x0100);	/* Driver Output Control */
-	ili9325_write(ili9325, 0x02, 0x0700);	/* LCD Driver Waveform Control */
-	ili9325_write(ili9325, 0x03, 0x1038);	/* Set the scan mode */
-	ili9325_write(ili9325, 0x04, 0x0000);	/* Scalling Control */
-	ili9325_write(ili9325, 0x08, 0x0202);	/* Display Control 2 */
-	ili9325_write(ili9325, 0x09, 0x0000);	/* Display Control 3 */
-	ili9325_write(ili9325, 0x0a, 0x0000);	/* Frame Cycle Contal */
-	ili9325_write(ili9325, 0x0c, BIT(0));	/* Extern Display Interface Control 1 */
-	ili9325_write(ili9325, 0x0d, 0x0000);	/* Frame Maker Position */
-	ili9325_write(ili9325, 0x0f, 0x0000);	/* Extern Display Interface Control 2 */
-	mdelay(50);
-	ili9325_write(ili9325, 0x07, 0x0101);	/* Display Control */
-	mdelay(50);
-	ili9325_write(ili9325, 0x10, BIT(12) | BIT(7) | BIT(6)); /* Power Control 1 */
-	ili9325_write(ili9325, 0x11, 0x0007);	/* Power Control 2 */
-	ili9325_write(ili9325, 0x12, BIT(8) | BIT(4));	/* Power Control 3 */
-	ili9325_write(ili9325, 0x13, 0x0b00);	/* Power Control 4 */
-	ili9325_write(ili9325, 0x29, 0x0000);	/* Power Control 7 */
-	ili9325_write(ili9325, 0x2b, BIT(14) | BIT(4));
-
-	ili9325_write(ili9325, 0x50, 0);	/* Set X Start */
-	ili9325_write(ili9325, 0x51, 239);	/* Set X End */
-	ili9325_write(ili9325, 0x52, 0);	/* Set Y Start */
-	ili9325_write(ili9325, 0x53, 319);	/* Set Y End */
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x60, 0x2700);	/* Driver Output Control */
-	ili9325_write(ili9325, 0x61, 0x0001);	/* Driver Output Control */
-	ili9325_write(ili9325, 0x6a, 0x0000);	/* Vertical Srcoll Control */
-
-	ili9325_write(ili9325, 0x80, 0x0000);	/* Display Position? Partial Display 1 */
-	ili9325_write(ili9325, 0x81, 0x0000);	/* RAM Address Start? Partial Display 1 */
-	ili9325_write(ili9325, 0x82, 0x0000);	/* RAM Address End-Partial Display 1 */
-	ili9325_write(ili9325, 0x83, 0x0000);	/* Displsy Position? Partial Display 2 */
-	ili9325_write(ili9325, 0x84, 0x0000);	/* RAM Address Start? Partial Display 2 */
-	ili9325_write(ili9325, 0x85, 0x0000);	/* RAM Address End? Partial Display 2 */
-
-	ili9325_write(ili9325, 0x90, 16); /* Frame Cycle Control */
-	ili9325_write(ili9325, 0x92, 0x0000);	/* Panel Interface Control 2 */
-	ili9325_write(ili9325, 0x93, 0x0001);	/* Panel Interface Control 3 */
-	ili9325_write(ili9325, 0x95, 0x0110);	/* Frame Cycle Control */
-	ili9325_write(ili9325, 0x97, 0);
-	ili9325_write(ili9325, 0x98, 0x0000);	/* Frame Cycle Control */
+	ili9325_queue_begin(ili9325);
+	ili9325_queue_seq(ili9325, &ili9325->init_seq);
 
 	switch (ili9325->rotation) {
 	case 0:
-		ili9325_write(ili9325, 0x0003, 0x1028);
+		ili9325_queue_write(ili9325, 0x0003, 0x1028);
 		ili9325->set_win_type = 3;
 		break;
 	case 90:
-		ili9325_write(ili9325, 0x0003, 0x1030);
+		ili9325_queue_write(ili9325, 0x0003, 0x1030);
 		ili9325->set_win_type = 0;
 		break;
 	case 180:
-		ili9325_write(ili9325, 0x0003, 0x1018);
+		ili9325_queue_write(ili9325, 0x0003, 0x1018);
 		ili9325->set_win_type = 1;
 		break;
 	case 270:
-		ili9325_write(ili9325, 0x0003, 0x1000);
+		ili9325_queue_write(ili9325, 0x0003, 0x1000);
 		ili9325->set_win_type = 2;
 		break;
 	}
 
-	ili9325_write(ili9325, 0x0007, 0x0133);
-	mdelay(100);
+	/* Display on once the scan direction is set */
+	ili9325_queue_write(ili9325, 0x0007, 0x0133);
+	ili9325_queue_msleep(ili9325, 100);
+
+	ret = ili9325_queue_end(ili9325);
+	if (ret) {
+		dev_err(dev, "Failed to write register\n");
+		goto out_exit;
+	}
 
+	if (autotune && !ili9325->tuned)
+		ili9325_autotune(ili9325);
+	ili9325_calibrate(ili9325);
+out_flush:
 	ili9325_enable_flush(ili9325, plane_state);
 out_exit:
 	drm_dev_exit(idx);
@@ -485,6 +1907,8 @@ static const struct drm_simple_display_pipe_funcs hy28a_funcs = {
 	.enable =  hy28a_pipe_enable,
 	.disable = ili9325_pipe_disable,
 	.update = ili9325_pipe_update,
+	.enable_vblank = ili9325_enable_vblank,
+	.disable_vblank = ili9325_disable_vblank,
 	.prepare_fb = drm_gem_fb_simple_display_pipe_prepare_fb,
 };
 
@@ -500,118 +1924,47 @@ static void hy28b_pipe_enable(struct drm_simple_display_pipe *pipe,
 	if (!drm_dev_enter(pipe->crtc.dev, &idx))
 		return;
 
-	ili9325_reset(ili9325);
-
-	/*
-	 * FIXME:
-	 * Apparently there are 2 versions of this display:
-	 * https://github.com/raspberrypi/linux/pull/2721
-	 *
-	 * The ILI9325D has the same ID code (0x9325) as the ILI9325, so it can't be detected at runtime.
-	 * Maybe the OTP registers are programmed?
-	 * SPI reading is controlled by register R66h on ILI9325D.
-	 */
-
-	/* Initialization sequence from HY28B example code */
-
-	ret = ili9325_write(ili9325, 0x00e7, 0x0010);
-	if (ret) {
-		dev_err(dev, "Failed to write register\n");
-		goto out_exit;
-	}
+	if (!ili9325_wake(ili9325))
+		goto out_flush;
 
-	ili9325_write(ili9325, 0x0000, 0x0001);
-	ili9325_write(ili9325, 0x0001, 0x0100);
-	ili9325_write(ili9325, 0x0002, 0x0700);
-	ili9325_write(ili9325, 0x0003, BIT(12) | BIT(5) | BIT(4));
-	ili9325_write(ili9325, 0x0004, 0x0000);
-	ili9325_write(ili9325, 0x0008, 0x0207);
-	ili9325_write(ili9325, 0x0009, 0x0000);
-	ili9325_write(ili9325, 0x000a, 0x0000);
-	ili9325_write(ili9325, 0x000c, 0x0001);
-	ili9325_write(ili9325, 0x000d, 0x0000);
-	ili9325_write(ili9325, 0x000f, 0x0000);
+	ili9325_reset(ili9325);
 
-	/* Power On sequence */
-	ili9325_write(ili9325, 0x0010, 0x0000);
-	ili9325_write(ili9325, 0x0011, 0x0007);
-	ili9325_write(ili9325, 0x0012, 0x0000);
-	ili9325_write(ili9325, 0x0013, 0x0000);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0010, 0x1590);
-	ili9325_write(ili9325, 0x0011, 0x0227);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0012, 0x009c);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0013, 0x1900);
-	ili9325_write(ili9325, 0x0029, 0x0023);
-	ili9325_write(ili9325, 0x002b, 0x000e);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0020, 0x0000);
-	ili9325_write(ili9325, 0x0021, 0x0000);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0030, 0x0007);
-	ili9325_write(ili9325, 0x0031, 0x0707);
-	ili9325_write(ili9325, 0x0032, 0x0006);
-	ili9325_write(ili9325, 0x0035, 0x0704);
-	ili9325_write(ili9325, 0x0036, 0x1f04);
-	ili9325_write(ili9325, 0x0037, 0x0004);
-	ili9325_write(ili9325, 0x0038, 0x0000);
-	ili9325_write(ili9325, 0x0039, 0x0706);
-	ili9325_write(ili9325, 0x003c, 0x0701);
-	ili9325_write(ili9325, 0x003d, 0x000f);
-	mdelay(50);
-
-	ili9325_write(ili9325, 0x0050, 0);
-	ili9325_write(ili9325, 0x0051, 239);
-	ili9325_write(ili9325, 0x0052, 0);
-	ili9325_write(ili9325, 0x0053, 319);
-
-	ili9325_write(ili9325, 0x0060, 0xa700);
-	ili9325_write(ili9325, 0x0061, 0x0001);
-	ili9325_write(ili9325, 0x006a, 0x0000);
-
-	ili9325_write(ili9325, 0x0080, 0x0000);
-	ili9325_write(ili9325, 0x0081, 0x0000);
-	ili9325_write(ili9325, 0x0082, 0x0000);
-	ili9325_write(ili9325, 0x0083, 0x0000);
-	ili9325_write(ili9325, 0x0084, 0x0000);
-	ili9325_write(ili9325, 0x0085, 0x0000);
-
-	ili9325_write(ili9325, 0x0090, 0x0010);
-	ili9325_write(ili9325, 0x0092, 0x0000);
-	ili9325_write(ili9325, 0x0093, 0x0003);
-	ili9325_write(ili9325, 0x0095, 0x0110);
-	ili9325_write(ili9325, 0x0097, 0x0000);
-	ili9325_write(ili9325, 0x0098, 0x0000);
+	ili9325_queue_begin(ili9325);
+	ili9325_queue_seq(ili9325, &ili9325->init_seq);
 
 	switch (ili9325->rotation) {
 	case 0:
-		ili9325_write(ili9325, 0x0003, 0x1018);
+		ili9325_queue_write(ili9325, 0x0003, 0x1018);
 		ili9325->set_win_type = 1;
 		break;
 	case 90:
-		ili9325_write(ili9325, 0x0003, 0x1000);
+		ili9325_queue_write(ili9325, 0x0003, 0x1000);
 		ili9325->set_win_type = 2;
 		break;
 	case 180:
-		ili9325_write(ili9325, 0x0003, 0x1028);
+		ili9325_queue_write(ili9325, 0x0003, 0x1028);
 		ili9325->set_win_type = 3;
 		break;
 	case 270:
-		ili9325_write(ili9325, 0x0003, 0x1030);
+		ili9325_queue_write(ili9325, 0x0003, 0x1030);
 		ili9325->set_win_type = 0;
 		break;
 	}
 
-	ili9325_write(ili9325, 0x0007, 0x0133);
-	mdelay(100);
+	/* Display on once the scan direction is set */
+	ili9325_queue_write(ili9325, 0x0007, 0x0133);
+	ili9325_queue_msleep(ili9325, 100);
 
+	ret = ili9325_queue_end(ili9325);
+	if (ret) {
+		dev_err(dev, "Failed to write register\n");
+		goto out_exit;
+	}
+
+	if (autotune && !ili9325->tuned)
+		ili9325_autotune(ili9325);
+	ili9325_calibrate(ili9325);
+out_flush:
 	ili9325_enable_flush(ili9325, plane_state);
 out_exit:
 	drm_dev_exit(idx);
@@ -621,6 +1974,8 @@ static const struct drm_simple_display_pipe_funcs hy28b_funcs = {
 	.enable =  hy28b_pipe_enable,
 	.disable = ili9325_pipe_disable,
 	.update = ili9325_pipe_update,
+	.enable_vblank = ili9325_enable_vblank,
+	.disable_vblank = ili9325_disable_vblank,
 	.prepare_fb = drm_gem_fb_simple_display_pipe_prepare_fb,
 };
 
@@ -759,6 +2114,98 @@ static const struct file_operations ili9325_debugfs_reg_fops = {
 	.write = ili9325_debugfs_reg_write,
 };
 
+static void ili9325_debugfs_tune_print(struct seq_file *m, const char *name, u64 ns)
+{
+	if (!ns)
+		return;
+
+	if (ns == U64_MAX)
+		seq_printf(m, "  %-16s failed\n", name);
+	else
+		seq_printf(m, "  %-16s %llu us\n", name, div_u64(ns, 1000));
+}
+
+static int ili9325_debugfs_transport_show(struct seq_file *m, void *d)
+{
+	struct tinydrm_ili9325 *ili9325 = m->private;
+	struct ili9325_tune *tune = &ili9325->tune;
+	char name[32];
+	unsigned int i;
+
+	mutex_lock(&ili9325->cmdlock);
+
+	seq_printf(m, "bits per word: %u\n", ili9325->pixel_bpw);
+	seq_printf(m, "max chunk: %zu\n", ili9325->pixel_max_chunk);
+	seq_printf(m, "slow max length: %zu\n", ili9325->slow_max_len);
+	seq_printf(m, "pixel clock: %u kHz\n", ili9325->pixel_speed_hz / 1000);
+	seq_printf(m, "flush cost: %u ns + %u ps/byte\n", ili9325->cost.setup_ns,
+		   ili9325->cost.byte_ps);
+
+	seq_printf(m, "\nbenchmark (%u bytes, byte swap included where needed):\n",
+		   ILI9325_TUNE_LEN);
+	ili9325_debugfs_tune_print(m, "16 bpw", tune->bpw_ns[0]);
+	ili9325_debugfs_tune_print(m, "8 bpw", tune->bpw_ns[1]);
+	for (i = 0; i < ARRAY_SIZE(ili9325_tune_chunks); i++) {
+		snprintf(name, sizeof(name), "chunk %zu",
+			 min(ili9325_max_chunk(ili9325), ili9325_tune_chunks[i]));
+		ili9325_debugfs_tune_print(m, name, tune->chunk_ns[i]);
+	}
+
+	seq_printf(m, "\nsmall writes (x%u):\n", ILI9325_TUNE_SMALL_COUNT);
+	for (i = 0; i < ARRAY_SIZE(ili9325_tune_small); i++) {
+		snprintf(name, sizeof(name), "%zu slow", ili9325_tune_small[i]);
+		ili9325_debugfs_tune_print(m, name, tune->slow_ns[i]);
+		snprintf(name, sizeof(name), "%zu fast", ili9325_tune_small[i]);
+		ili9325_debugfs_tune_print(m, name, tune->fast_ns[i]);
+	}
+
+	mutex_unlock(&ili9325->cmdlock);
+
+	return 0;
+}
+
+/*
+ * Writing anything reruns the benchmark. The display has to be off with the
+ * panel initialized, that is asleep after having been enabled.
+ */
+static ssize_t ili9325_debugfs_transport_write(struct file *file,
+					       const char __user *user_buf,
+					       size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct tinydrm_ili9325 *ili9325 = m->private;
+	struct drm_device *drm = &ili9325->drm;
+	int idx, ret = 0;
+
+	if (!drm_dev_enter(drm, &idx))
+		return -ENODEV;
+
+	drm_modeset_lock_all(drm);
+	if (ili9325->enabled || !ili9325->asleep)
+		ret = -EBUSY;
+	else
+		ili9325_autotune(ili9325);
+	drm_modeset_unlock_all(drm);
+
+	drm_dev_exit(idx);
+
+	return ret < 0 ? ret : count;
+}
+
+static int ili9325_debugfs_transport_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ili9325_debugfs_transport_show, inode->i_private);
+}
+
+static const struct file_operations ili9325_debugfs_transport_fops = {
+	.owner = THIS_MODULE,
+	.open = ili9325_debugfs_transport_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = ili9325_debugfs_transport_write,
+};
+
 static int ili9325_debugfs_init(struct drm_minor *minor)
 {
 	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(minor->dev);
@@ -769,6 +2216,9 @@ static int ili9325_debugfs_init(struct drm_minor *minor)
 
 	debugfs_create_file("registers", mode, minor->debugfs_root,
 			    ili9325, &ili9325_debugfs_reg_fops);
+	debugfs_create_file("transport", S_IFREG | S_IRUGO | S_IWUSR, minor->debugfs_root,
+			    ili9325, &ili9325_debugfs_transport_fops);
+	tinydrm_flush_debugfs_init(&ili9325->flush, minor->debugfs_root);
 
 	return 0;
 }
@@ -793,6 +2243,22 @@ static const uint32_t ili9325_formats[] = {
 	DRM_FORMAT_XRGB8888,
 };
 
+/*
+ * The panel byte order, this can be sent without touching the pixels when
+ * the bytes are swapped. Older kernels don't know about this format.
+ */
+static const uint32_t ili9325_formats_be[] = {
+	DRM_FORMAT_RGB565 | DRM_FORMAT_BIG_ENDIAN,
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_XRGB8888,
+};
+
+static const uint32_t ili9325_formats_be_last[] = {
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_RGB565 | DRM_FORMAT_BIG_ENDIAN,
+};
+
 static const uint64_t ili9325_modifiers[] = {
 	DRM_FORMAT_MOD_LINEAR,
 	DRM_FORMAT_MOD_INVALID
@@ -804,13 +2270,13 @@ static const struct drm_mode_config_funcs ili9325_mode_config_funcs = {
 	.atomic_commit = drm_atomic_helper_commit,
 };
 
-DEFINE_DRM_GEM_CMA_FOPS(ili9325_fops);
+DEFINE_TINYDRM_GEM_FOPS(ili9325_fops);
 
 static struct drm_driver ili9325_driver = {
 	.driver_features	= DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
 	.fops			= &ili9325_fops,
 	.release		= fb_ili9325_release,
-	DRM_GEM_CMA_VMAP_DRIVER_OPS,
+	TINYDRM_GEM_DRIVER_OPS,
 	.debugfs_init		= ili9325_debugfs_init,
 	.name			= "ili9325",
 	.desc			= "Ilitek ILI9325",
@@ -819,35 +2285,56 @@ static struct drm_driver ili9325_driver = {
 	.minor			= 0,
 };
 
+struct ili9325_panel {
+	const struct drm_simple_display_pipe_funcs *funcs;
+	const u8 *init_seq;
+	size_t init_seq_len;
+};
+
+static const struct ili9325_panel hy28a_panel = {
+	.funcs = &hy28a_funcs,
+	.init_seq = hy28a_init_seq,
+	.init_seq_len = sizeof(hy28a_init_seq),
+};
+
+static const struct ili9325_panel hy28b_panel = {
+	.funcs = &hy28b_funcs,
+	.init_seq = hy28b_init_seq,
+	.init_seq_len = sizeof(hy28b_init_seq),
+};
+
 static const struct of_device_id ili9325_of_match[] = {
-	{ .compatible = "haoyu,hy28a", .data = &hy28a_funcs },
-	{ .compatible = "haoyu,hy28b", .data = &hy28b_funcs },
+	{ .compatible = "haoyu,hy28a", .data = &hy28a_panel },
+	{ .compatible = "haoyu,hy28b", .data = &hy28b_panel },
 	{},
 };
 MODULE_DEVICE_TABLE(of, ili9325_of_match);
 
 static const struct spi_device_id ili9325_spi_ids[] = {
-	{ "hy28a", (unsigned long)&hy28a_funcs },
-	{ "hy28b", (unsigned long)&hy28b_funcs },
+	{ "hy28a", (unsigned long)&hy28a_panel },
+	{ "hy28b", (unsigned long)&hy28b_panel },
 	{ },
 };
 MODULE_DEVICE_TABLE(spi, ili9325_spi_ids);
 
 static int ili9325_probe_spi(struct spi_device *spi)
 {
-	const struct drm_simple_display_pipe_funcs *funcs;
+	const struct ili9325_panel *panel;
 	struct tinydrm_ili9325 *ili9325;
+	const uint32_t *formats;
+	unsigned int num_formats;
 	struct device *dev = &spi->dev;
 	struct drm_device *drm;
 	u32 rotation = 0;
+	u32 fps;
 	u16 devcode;
 	int ret;
 
-	funcs = device_get_match_data(dev);
-	if (!funcs) {
+	panel = device_get_match_data(dev);
+	if (!panel) {
 		const struct spi_device_id *spi_id = spi_get_device_id(spi);
 
-		funcs = (const struct drm_simple_display_pipe_funcs *)spi_id->driver_data;
+		panel = (const struct ili9325_panel *)spi_id->driver_data;
 	}
 
 	/* The SPI device is used to allocate dma memory */
@@ -864,10 +2351,16 @@ static int ili9325_probe_spi(struct spi_device *spi)
 		return -ENOMEM;
 
 	ili9325->spi = spi;
-#ifdef __LITTLE_ENDIAN
-	if (!spi_is_bpw_supported(spi, 16))
-		ili9325->swap_bytes = true;
-#endif
+	ili9325->pixel_speed_hz = spi->max_speed_hz;
+	ili9325->verify_next = jiffies;
+	ili9325_cost_init(ili9325);
+	tinydrm_flush_init(&ili9325->flush, &ili9325->pipe.crtc, ili9325_flush);
+	INIT_WORK(&ili9325->mode_work, ili9325_mode_work);
+	mutex_init(&ili9325->cmdlock);
+	init_completion(&ili9325->queue_done);
+	ili9325->cmdbuf.startbyte = ili9325_get_startbyte(0, 1, false);
+	ili9325->cmdbuf.read_tx[0] = ili9325_get_startbyte(0, 1, true);
+	ili9325->cmdbuf.verify_tx[0] = ili9325_get_startbyte(0, 1, true);
 	drm = &ili9325->drm;
 	ret = devm_drm_dev_init(dev, drm, &ili9325_driver);
 	if (ret) {
@@ -893,13 +2386,78 @@ static int ili9325_probe_spi(struct spi_device *spi)
 		return ret;
 	}
 
-	ili9325->tx_buf = devm_kmalloc(dev, 320 * 240 * 2, GFP_KERNEL);
-	if (!ili9325->tx_buf)
+	ili9325->queue_xfers = devm_kcalloc(dev, ILI9325_QUEUE_XFERS,
+					    sizeof(*ili9325->queue_xfers),
+					    GFP_KERNEL);
+	if (!ili9325->queue_xfers)
+		return -ENOMEM;
+
+	ret = ili9325_pixel_xfers_prepare(ili9325, 320 * 240 * 2);
+	if (ret)
+		return ret;
+
+	ili9325->regmap = devm_regmap_init(dev, &ili9325_regmap_bus, ili9325,
+					   &ili9325_regmap_config);
+	if (IS_ERR(ili9325->regmap)) {
+		dev_err(dev, "Failed to init regmap\n");
+		return PTR_ERR(ili9325->regmap);
+	}
+
+	ret = devm_tinydrm_seq_load(dev, &ili9325->init_seq, 2, panel->init_seq,
+				    panel->init_seq_len);
+	if (ret)
+		return ret;
+
+	ret = ili9325_seq_validate(dev, &ili9325->init_seq);
+	if (ret)
+		return ret;
+
+	ili9325->fill_buf = devm_kmalloc(dev, ILI9325_FILL_SIZE, GFP_KERNEL);
+	if (!ili9325->fill_buf)
+		return -ENOMEM;
+
+	/* XRGB8888 */
+	ili9325->row_buf = devm_kmalloc(dev, 320 * 4, GFP_KERNEL);
+	if (!ili9325->row_buf)
 		return -ENOMEM;
 
+	if (shadow) {
+		ili9325->shadow = devm_kzalloc(dev, 320 * 240 * 2, GFP_KERNEL);
+		ili9325->diff_buf = devm_kmalloc_array(dev, TINYDRM_DIFF_BAND_ROWS * 320,
+						       sizeof(u16), GFP_KERNEL);
+		if (!ili9325->shadow || !ili9325->diff_buf)
+			return -ENOMEM;
+	}
+
+	if (stream && !shadow) {
+		ret = ili9325_bands_prepare(ili9325);
+		if (ret == -ENOMEM)
+			return ret;
+		if (ret)
+			dev_warn(dev, "Transfers are too small for stream mode\n");
+		else
+			ili9325->stream = true;
+	}
+
+	if (!ili9325->stream) {
+		ili9325->tx_buf[0] = devm_kmalloc(dev, 320 * 240 * 2, GFP_KERNEL);
+		if (!ili9325->tx_buf[0])
+			return -ENOMEM;
+	}
+
+	if (async && !ili9325->stream) {
+		ili9325->tx_buf[1] = devm_kmalloc(dev, 320 * 240 * 2, GFP_KERNEL);
+		if (!ili9325->tx_buf[1])
+			return -ENOMEM;
+	}
+
 	device_property_read_u32(dev, "rotation", &rotation);
 	ili9325->rotation = rotation;
 
+	/* Leaves bus time for the touch controller on the same SPI bus */
+	if (!device_property_read_u32(dev, "fps", &fps))
+		tinydrm_flush_set_fps(&ili9325->flush, fps);
+
 	/*
 	 * FIXME:
 	 * Rotating the mode like this won't be accepted in mainline anymore.
@@ -928,6 +2486,7 @@ static int ili9325_probe_spi(struct spi_device *spi)
 		dev_err(dev, "Illegal rotation value %u\n", rotation);
 		return -EINVAL;
 	}
+	tinydrm_mode_set_bus_clock(&ili9325->mode, ili9325->pixel_speed_hz, 16);
 
 	drm->mode_config.min_width = ili9325->mode.hdisplay;
 	drm->mode_config.max_width = ili9325->mode.hdisplay;
@@ -942,12 +2501,27 @@ static int ili9325_probe_spi(struct spi_device *spi)
 	if (ret)
 		return ret;
 
-	ret = drm_simple_display_pipe_init(drm, &ili9325->pipe, funcs,
-					   ili9325_formats, ARRAY_SIZE(ili9325_formats),
+	/* Prefer the format that is sent as is */
+	if (!__drm_format_info(DRM_FORMAT_RGB565 | DRM_FORMAT_BIG_ENDIAN)) {
+		formats = ili9325_formats;
+		num_formats = ARRAY_SIZE(ili9325_formats);
+	} else {
+		formats = ili9325->swap_bytes ? ili9325_formats_be : ili9325_formats_be_last;
+		num_formats = ARRAY_SIZE(ili9325_formats_be);
+	}
+
+	ret = drm_simple_display_pipe_init(drm, &ili9325->pipe, panel->funcs,
+					   formats, num_formats,
 					   ili9325_modifiers, &ili9325->connector);
 	if (ret)
 		return ret;
 
+	drm_plane_enable_fb_damage_clips(&ili9325->pipe.plane);
+
+	ret = tinydrm_flush_vblank_init(&ili9325->flush);
+	if (ret)
+		return ret;
+
 	/* FIXME: If there's no use for devcode, this can be moved to ili9325_debugfs_init() */
 	/* We read garbage if SPI MISO is not wired up */
 	ret = ili9325_read(ili9325, 0x0000, &devcode);
@@ -977,6 +2551,7 @@ static int ili9325_remove(struct spi_device *spi)
 
 	drm_dev_unplug(drm);
 	drm_atomic_helper_shutdown(drm);
+	cancel_work_sync(&drm_to_ili9325(drm)->mode_work);
 
 	return 0;
 }
@@ -986,11 +2561,33 @@ static void ili9325_shutdown(struct spi_device *spi)
 	drm_atomic_helper_shutdown(spi_get_drvdata(spi));
 }
 
+static int __maybe_unused ili9325_pm_suspend(struct device *dev)
+{
+	return drm_mode_config_helper_suspend(dev_get_drvdata(dev));
+}
+
+static int __maybe_unused ili9325_pm_resume(struct device *dev)
+{
+	struct drm_device *drm = dev_get_drvdata(dev);
+	struct tinydrm_ili9325 *ili9325 = drm_to_ili9325(drm);
+
+	/* Without readback there's no telling if the controller kept its state */
+	if (!ili9325->devcode)
+		ili9325->asleep = false;
+
+	drm_mode_config_helper_resume(drm);
+
+	return 0;
+}
+
+static SIMPLE_DEV_PM_OPS(ili9325_pm_ops, ili9325_pm_suspend, ili9325_pm_resume);
+
 static struct spi_driver ili9325_spi_driver = {
 	.driver = {
 		.name   = "ili9325",
 		.owner  = THIS_MODULE,
 		.of_match_table = of_match_ptr(ili9325_of_match),
+		.pm = &ili9325_pm_ops,
 	},
 	.id_table = ili9325_spi_ids,
 	.probe = ili9325_probe_spi,
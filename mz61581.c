@@ -25,40 +25,58 @@
 
 #include <video/mipi_display.h>
 
+#include "tinydrm-helpers.h"
+
+struct mz61581 {
+	/* Must be first, it's freed by mipi_dbi_release() */
+	struct tinydrm_mipi_dbi tdbi;
+	struct tinydrm_seq init_seq;
+};
+
 /* Renesas R61581 controller with a CPLD SPI conversion in front */
+static const u8 mz61581_init_seq[] = {
+	TINYDRM_SEQ_CMD(0xb0, 0x00),
+	TINYDRM_SEQ_CMD(MIPI_DCS_EXIT_SLEEP_MODE),
+	TINYDRM_SEQ_DELAY(120),
+
+	TINYDRM_SEQ_CMD(0xb3, 0x02, 0x00, 0x00, 0x00),
+	TINYDRM_SEQ_CMD(0xc0, 0x13, 0x3b, 0x00, 0x02,
+			      0x00, 0x01, 0x00, 0x43),
+	TINYDRM_SEQ_CMD(0xc1, 0x08, 0x16, 0x08, 0x08),
+	TINYDRM_SEQ_CMD(0xc4, 0x11, 0x07, 0x03, 0x03),
+	TINYDRM_SEQ_CMD(0xc6, 0x00),
+	TINYDRM_SEQ_CMD(0xc8, 0x03, 0x03, 0x13, 0x5c, 0x03,
+			      0x07, 0x14, 0x08, 0x00, 0x21,
+			      0x08, 0x14, 0x07, 0x53, 0x0c,
+			      0x13, 0x03, 0x03, 0x21, 0x00),
+	TINYDRM_SEQ_CMD(MIPI_DCS_SET_TEAR_ON, 0x00),
+	TINYDRM_SEQ_CMD(MIPI_DCS_SET_ADDRESS_MODE, 0xa0),
+	TINYDRM_SEQ_CMD(MIPI_DCS_SET_PIXEL_FORMAT, 0x55),
+	TINYDRM_SEQ_CMD(MIPI_DCS_SET_TEAR_SCANLINE, 0x00, 0x01),
+	TINYDRM_SEQ_CMD(0xd0, 0x07, 0x07, 0x1d, 0x03),
+	TINYDRM_SEQ_CMD(0xd1, 0x03, 0x30, 0x10),
+	TINYDRM_SEQ_CMD(0xd2, 0x03, 0x14, 0x04),
+};
+
 static void mz61581_enable(struct drm_simple_display_pipe *pipe,
 			   struct drm_crtc_state *crtc_state,
 			   struct drm_plane_state *plane_state)
 {
 	struct mipi_dbi_dev *dbidev = drm_to_mipi_dbi_dev(pipe->crtc.dev);
+	struct mz61581 *mz = container_of(dbidev, struct mz61581, tdbi.dbidev);
 	struct mipi_dbi *dbi = &dbidev->dbi;
 	u8 addr_mode;
+	int ret;
 
 	DRM_DEBUG_KMS("\n");
 
 	mipi_dbi_hw_reset(dbi);
 
-	mipi_dbi_command(dbi, 0xb0, 0x00);
-	mipi_dbi_command(dbi, MIPI_DCS_EXIT_SLEEP_MODE);
-	msleep(120);
-
-	mipi_dbi_command(dbi, 0xb3, 0x02, 0x00, 0x00, 0x00);
-	mipi_dbi_command(dbi, 0xc0, 0x13, 0x3b, 0x00, 0x02,
-				     0x00, 0x01, 0x00, 0x43);
-	mipi_dbi_command(dbi, 0xc1, 0x08, 0x16, 0x08, 0x08);
-	mipi_dbi_command(dbi, 0xc4, 0x11, 0x07, 0x03, 0x03);
-	mipi_dbi_command(dbi, 0xc6, 0x00);
-	mipi_dbi_command(dbi, 0xc8, 0x03, 0x03, 0x13, 0x5c, 0x03,
-				     0x07, 0x14, 0x08, 0x00, 0x21,
-				     0x08, 0x14, 0x07, 0x53, 0x0c,
-				     0x13, 0x03, 0x03, 0x21, 0x00);
-	mipi_dbi_command(dbi, MIPI_DCS_SET_TEAR_ON, 0x00);
-	mipi_dbi_command(dbi, MIPI_DCS_SET_ADDRESS_MODE, 0xa0);
-	mipi_dbi_command(dbi, MIPI_DCS_SET_PIXEL_FORMAT, 0x55);
-	mipi_dbi_command(dbi, MIPI_DCS_SET_TEAR_SCANLINE, 0x00, 0x01);
-	mipi_dbi_command(dbi, 0xd0, 0x07, 0x07, 0x1d, 0x03);
-	mipi_dbi_command(dbi, 0xd1, 0x03, 0x30, 0x10);
-	mipi_dbi_command(dbi, 0xd2, 0x03, 0x14, 0x04);
+	ret = tinydrm_seq_run_mipi_dbi(dbi, &mz->init_seq);
+	if (ret) {
+		dev_err(pipe->crtc.dev->dev, "Failed to send init sequence %d\n", ret);
+		return;
+	}
 
 #define MY BIT(7)
 #define MX BIT(6)
@@ -84,13 +102,15 @@ static void mz61581_enable(struct drm_simple_display_pipe *pipe,
 
 	mipi_dbi_command(dbi, MIPI_DCS_SET_DISPLAY_ON);
 
-	mipi_dbi_enable_flush(dbidev, crtc_state, plane_state);
+	tinydrm_mipi_dbi_enable_flush(dbidev, crtc_state, plane_state);
 }
 
 static const struct drm_simple_display_pipe_funcs mz61581_funcs = {
 	.enable = mz61581_enable,
-	.disable = mipi_dbi_pipe_disable,
-	.update = mipi_dbi_pipe_update,
+	.disable = tinydrm_mipi_dbi_pipe_disable,
+	.update = tinydrm_mipi_dbi_pipe_update,
+	.enable_vblank = tinydrm_mipi_dbi_enable_vblank,
+	.disable_vblank = tinydrm_mipi_dbi_disable_vblank,
 	.prepare_fb = drm_gem_fb_simple_display_pipe_prepare_fb,
 };
 
@@ -98,11 +118,14 @@ static const struct drm_display_mode mz61581_mode = {
 	DRM_SIMPLE_MODE(480, 320, 73, 49),
 };
 
+DEFINE_TINYDRM_GEM_FOPS(mz61581_fops);
+
 static struct drm_driver mz61581_driver = {
 	.driver_features	= DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
+	.fops			= &mz61581_fops,
 	.release		= mipi_dbi_release,
-	DRM_GEM_CMA_VMAP_DRIVER_OPS,
-	.debugfs_init		= mipi_dbi_debugfs_init,
+	TINYDRM_GEM_DRIVER_OPS,
+	.debugfs_init		= tinydrm_mipi_dbi_debugfs_init,
 	.name			= "mz61581",
 	.desc			= "Tontec mz61581",
 	.date			= "20170316",
@@ -129,18 +152,20 @@ static int mz61581_probe(struct spi_device *spi)
 	struct drm_device *drm;
 	struct mipi_dbi *dbi;
 	struct gpio_desc *dc;
+	struct mz61581 *mz;
 	u32 rotation = 0;
 	int ret;
 
-	dbidev = kzalloc(sizeof(*dbidev), GFP_KERNEL);
-	if (!dbidev)
+	mz = kzalloc(sizeof(*mz), GFP_KERNEL);
+	if (!mz)
 		return -ENOMEM;
 
+	dbidev = &mz->tdbi.dbidev;
 	dbi = &dbidev->dbi;
 	drm = &dbidev->drm;
 	ret = devm_drm_dev_init(dev, drm, &mz61581_driver);
 	if (ret) {
-		kfree(dbi);
+		kfree(mz);
 		return ret;
 	}
 
@@ -164,6 +189,11 @@ static int mz61581_probe(struct spi_device *spi)
 
 	device_property_read_u32(dev, "rotation", &rotation);
 
+	ret = devm_tinydrm_seq_load(dev, &mz->init_seq, 1, mz61581_init_seq,
+				    sizeof(mz61581_init_seq));
+	if (ret)
+		return ret;
+
 	ret = mipi_dbi_spi_init(spi, dbi, dc);
 	if (ret)
 		return ret;
@@ -171,7 +201,7 @@ static int mz61581_probe(struct spi_device *spi)
 	/* Reading is not supported */
 	dbi->read_commands = NULL;
 
-	ret = mipi_dbi_dev_init(dbidev, &mz61581_funcs, &mz61581_mode, rotation);
+	ret = tinydrm_mipi_dbi_dev_init(&mz->tdbi, &mz61581_funcs, &mz61581_mode, rotation);
 	if (ret)
 		return ret;
 
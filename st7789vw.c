@@ -21,6 +21,8 @@
 #include <drm/drm_gem_framebuffer_helper.h>
 #include <drm/drm_mipi_dbi.h>
 
+#include "tinydrm-helpers.h"
+
 #define ST7789VW_FRMCTR1		0xb1
 #define ST7789VW_FRMCTR2		0xb2
 #define ST7789VW_FRMCTR3		0xb3
@@ -38,11 +40,41 @@
 #define ST7789VW_MX	BIT(6)
 #define ST7789VW_MV	BIT(5)
 
+struct st7789vw {
+	/* Must be first, it's freed by mipi_dbi_release() */
+	struct tinydrm_mipi_dbi tdbi;
+	struct tinydrm_seq init_seq;
+};
+
+static const u8 jd_t18003_t01_init_seq[] = {
+	TINYDRM_SEQ_CMD(0x36, 0x70),
+	TINYDRM_SEQ_CMD(0x3A, 0x05),
+	TINYDRM_SEQ_CMD(0xB2, 0x0C, 0x0C, 0x00, 0x33, 0x33),
+	TINYDRM_SEQ_CMD(0xB7, 0x35),
+	TINYDRM_SEQ_CMD(0xBB, 0x19),
+	TINYDRM_SEQ_CMD(0xC0, 0x2C),
+	TINYDRM_SEQ_CMD(0xC2, 0x01),
+	TINYDRM_SEQ_CMD(0xC3, 0x12),
+	TINYDRM_SEQ_CMD(0xC4, 0x20),
+	TINYDRM_SEQ_CMD(0xC6, 0x0F),
+	TINYDRM_SEQ_CMD(0xD0, 0xA4, 0xA1),
+	TINYDRM_SEQ_CMD(0xE0, 0xD0, 0x04, 0x0D, 0x11, 0x13, 0x2B, 0x3F,
+			      0x54, 0x4C, 0x18, 0x0D, 0x0B, 0x1F, 0x23),
+	TINYDRM_SEQ_CMD(0xE1, 0xD0, 0x04, 0x0C, 0x11, 0x13, 0x2C, 0x3F,
+			      0x44, 0x51, 0x2F, 0x1F, 0x1F, 0x20, 0x23),
+	TINYDRM_SEQ_CMD(0x21),
+	TINYDRM_SEQ_CMD(0x35, 0x00),
+	TINYDRM_SEQ_CMD(0x11),
+	TINYDRM_SEQ_CMD(0x29),
+	TINYDRM_SEQ_DELAY(20),
+};
+
 static void jd_t18003_t01_pipe_enable(struct drm_simple_display_pipe *pipe,
 				      struct drm_crtc_state *crtc_state,
 				      struct drm_plane_state *plane_state)
 {
 	struct mipi_dbi_dev *dbidev = drm_to_mipi_dbi_dev(pipe->crtc.dev);
+	struct st7789vw *st = container_of(dbidev, struct st7789vw, tdbi.dbidev);
 	struct mipi_dbi *dbi = &dbidev->dbi;
 	int ret, idx;
 
@@ -54,49 +86,23 @@ static void jd_t18003_t01_pipe_enable(struct drm_simple_display_pipe *pipe,
 	if (ret)
 		goto out_exit;
 
-        mipi_dbi_command(dbi,0x36, 0x70);
-
-        mipi_dbi_command(dbi,0x3A,0x05);
-
-        mipi_dbi_command(dbi,0xB2,0x0C,0x0C,0x00,0x33,0x33);
-
-        mipi_dbi_command(dbi,0xB7,0x35);
-
-        mipi_dbi_command(dbi,0xBB,0x19);
-
-        mipi_dbi_command(dbi,0xC0,0x2C);
-
-        mipi_dbi_command(dbi,0xC2,0x01);
-
-        mipi_dbi_command(dbi,0xC3,0x12);
-
-        mipi_dbi_command(dbi,0xC4,0x20);
-
-        mipi_dbi_command(dbi,0xC6,0x0F);
-
-        mipi_dbi_command(dbi,0xD0,0xA4,0xA1);
-
-        mipi_dbi_command(dbi,0xE0,0xD0,0x04,0x0D,0x11,0x13,0x2B,0x3F,0x54,0x4C,0x18,0x0D,0x0B,0x1F,0x23);
-
-        mipi_dbi_command(dbi,0xE1,0xD0,0x04,0x0C,0x11,0x13,0x2C,0x3F,0x44,0x51,0x2F,0x1F,0x1F,0x20,0x23);
-
-        mipi_dbi_command(dbi,0x21);
-
-        mipi_dbi_command(dbi,0x11);
-
-        mipi_dbi_command(dbi,0x29);
-
-	msleep(20);
+	ret = tinydrm_seq_run_mipi_dbi(dbi, &st->init_seq);
+	if (ret) {
+		DRM_DEV_ERROR(pipe->crtc.dev->dev, "Failed to send init sequence %d\n", ret);
+		goto out_exit;
+	}
 
-	mipi_dbi_enable_flush(dbidev, crtc_state, plane_state);
+	tinydrm_mipi_dbi_enable_flush(dbidev, crtc_state, plane_state);
 out_exit:
 	drm_dev_exit(idx);
 }
 
 static const struct drm_simple_display_pipe_funcs jd_t18003_t01_pipe_funcs = {
 	.enable		= jd_t18003_t01_pipe_enable,
-	.disable	= mipi_dbi_pipe_disable,
-	.update		= mipi_dbi_pipe_update,
+	.disable	= tinydrm_mipi_dbi_pipe_disable,
+	.update		= tinydrm_mipi_dbi_pipe_update,
+	.enable_vblank	= tinydrm_mipi_dbi_enable_vblank,
+	.disable_vblank	= tinydrm_mipi_dbi_disable_vblank,
 	.prepare_fb	= drm_gem_fb_simple_display_pipe_prepare_fb,
 };
 
@@ -104,14 +110,14 @@ static const struct drm_display_mode jd_t18003_t01_mode = {
 	DRM_SIMPLE_MODE(240, 240, 20, 20),
 };
 
-DEFINE_DRM_GEM_CMA_FOPS(ST7789VW_fops);
+DEFINE_TINYDRM_GEM_FOPS(ST7789VW_fops);
 
 static struct drm_driver ST7789VW_driver = {
 	.driver_features	= DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
 	.fops			= &ST7789VW_fops,
 	.release		= mipi_dbi_release,
-	DRM_GEM_CMA_VMAP_DRIVER_OPS,
-	.debugfs_init		= mipi_dbi_debugfs_init,
+	TINYDRM_GEM_DRIVER_OPS,
+	.debugfs_init		= tinydrm_mipi_dbi_debugfs_init,
 	.name			= "ST7789VW",
 	.desc			= "Sitronix ST7789VW",
 	.date			= "20171128",
@@ -139,18 +145,20 @@ static int ST7789VW_probe(struct spi_device *spi)
 	struct drm_device *drm;
 	struct mipi_dbi *dbi;
 	struct gpio_desc *dc;
+	struct st7789vw *st;
 	u32 rotation = 0;
 	int ret;
 
-	dbidev = kzalloc(sizeof(*dbidev), GFP_KERNEL);
-	if (!dbidev)
+	st = kzalloc(sizeof(*st), GFP_KERNEL);
+	if (!st)
 		return -ENOMEM;
 
+	dbidev = &st->tdbi.dbidev;
 	dbi = &dbidev->dbi;
 	drm = &dbidev->drm;
 	ret = devm_drm_dev_init(dev, drm, &ST7789VW_driver);
 	if (ret) {
-		kfree(dbidev);
+		kfree(st);
 		return ret;
 	}
 
@@ -174,6 +182,11 @@ static int ST7789VW_probe(struct spi_device *spi)
 
 	device_property_read_u32(dev, "rotation", &rotation);
 
+	ret = devm_tinydrm_seq_load(dev, &st->init_seq, 1, jd_t18003_t01_init_seq,
+				    sizeof(jd_t18003_t01_init_seq));
+	if (ret)
+		return ret;
+
 	ret = mipi_dbi_spi_init(spi, dbi, dc);
 	spi->mode = SPI_MODE_3;
 	if (ret)
@@ -182,7 +195,8 @@ static int ST7789VW_probe(struct spi_device *spi)
 	/* Cannot read from Adafruit 1.8" display via SPI */
 	dbi->read_commands = NULL;
 
-	ret = mipi_dbi_dev_init(dbidev, &jd_t18003_t01_pipe_funcs, &jd_t18003_t01_mode, rotation);
+	ret = tinydrm_mipi_dbi_dev_init(&st->tdbi, &jd_t18003_t01_pipe_funcs,
+					&jd_t18003_t01_mode, rotation);
 	if (ret)
 		return ret;
 
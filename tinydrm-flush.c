@@ -0,0 +1,512 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Flush worker for the tiny DRM drivers
+ *
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#include <linux/debugfs.h>
+#include <linux/hrtimer.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+
+#include <drm/drm_crtc.h>
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_device.h>
+#include <drm/drm_file.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_modes.h>
+#include <drm/drm_plane.h>
+#include <drm/drm_rect.h>
+#include <drm/drm_vblank.h>
+
+#include "tinydrm-helpers.h"
+
+/*
+ * A commit only records the framebuffer and the damage, the worker does the
+ * transfer. The next commit waits for the page flip event of the previous
+ * one, and that isn't sent before the worker has picked up the frame. So
+ * there's at most one frame waiting no matter how fast the commits come in.
+ *
+ * The page flip event goes with the frame and is sent as soon as the driver
+ * has copied what it needs out of the framebuffer, see tinydrm_flush_latch().
+ * So the client gets its buffer back while the data is still being sent.
+ * The event timestamp is when the last of the data has been sent, or the next
+ * TE pulse after that, which for an event sent early is the expected time.
+ *
+ * With a frame rate cap a flush isn't started until a frame period after the
+ * previous one started. The pending frame holds its event meanwhile, so the
+ * client is throttled by its next commit waiting for it. Should a frame still
+ * be replaced before it's flushed, its damage is merged into the new one and
+ * it's counted as dropped.
+ *
+ * The plane update comes before the enable in a commit, so damage queued
+ * before tinydrm_flush_start() waits for it. That way the first flush also
+ * goes through the worker and never runs next to it.
+ *
+ * There's no scanout to take vblank from, so a timer emulates it at the rate
+ * frames can actually be delivered, the time a flush takes. Until a flush has
+ * been timed the mode refresh rate is used, see tinydrm_mode_set_bus_clock().
+ * The frame rate cap is left to the flush timer since it holds the events.
+ * The period is kept below the 100 ms that
+ * drm_atomic_helper_wait_for_vblanks() waits before it warns, slow panels
+ * just get more than one tick per frame.
+ */
+
+/* Until a flush has been timed */
+#define TINYDRM_FLUSH_VBLANK_DEFAULT_NS	(NSEC_PER_SEC / 60)
+#define TINYDRM_FLUSH_VBLANK_MAX_NS	(50 * NSEC_PER_MSEC)
+
+static void tinydrm_flush_work(struct work_struct *work)
+{
+	struct tinydrm_flush *flush = container_of(work, struct tinydrm_flush, work);
+	struct drm_rect clips[TINYDRM_FLUSH_MAX_CLIPS];
+	struct drm_framebuffer *fb;
+	unsigned int num_clips;
+	ktime_t start;
+	u64 ns;
+
+	start = ktime_get();
+
+	spin_lock(&flush->lock);
+	fb = flush->fb;
+	num_clips = flush->num_clips;
+	memcpy(clips, flush->clips, num_clips * sizeof(*clips));
+	flush->latch_event = flush->event;
+	flush->fb = NULL;
+	flush->num_clips = 0;
+	flush->event = NULL;
+	if (fb)
+		flush->last = start;
+	spin_unlock(&flush->lock);
+
+	if (!fb)
+		return;
+
+	flush->func(flush, fb, clips, num_clips);
+	tinydrm_flush_latch(flush, 0);
+	drm_framebuffer_put(fb);
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (flush->flush_ns)
+		ns = (3 * flush->flush_ns + ns) / 4;
+	WRITE_ONCE(flush->flush_ns, min_t(u64, ns, NSEC_PER_SEC));
+
+	spin_lock(&flush->lock);
+	flush->flushed++;
+	spin_unlock(&flush->lock);
+}
+
+static enum hrtimer_restart tinydrm_flush_timer(struct hrtimer *timer)
+{
+	struct tinydrm_flush *flush = container_of(timer, struct tinydrm_flush, timer);
+
+	queue_work(system_highpri_wq, &flush->work);
+
+	return HRTIMER_NORESTART;
+}
+
+static u64 tinydrm_flush_vblank_period(struct tinydrm_flush *flush)
+{
+	u64 ns = READ_ONCE(flush->flush_ns);
+
+	if (!ns && flush->crtc->mode.vrefresh)
+		ns = div_u64(NSEC_PER_SEC, flush->crtc->mode.vrefresh);
+	if (!ns)
+		ns = TINYDRM_FLUSH_VBLANK_DEFAULT_NS;
+
+	return clamp_t(u64, ns, NSEC_PER_MSEC, TINYDRM_FLUSH_VBLANK_MAX_NS);
+}
+
+static enum hrtimer_restart tinydrm_flush_vblank_timer(struct hrtimer *timer)
+{
+	struct tinydrm_flush *flush = container_of(timer, struct tinydrm_flush, vblank_timer);
+
+	if (!drm_crtc_handle_vblank(flush->crtc))
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ns_to_ktime(tinydrm_flush_vblank_period(flush)));
+
+	return HRTIMER_RESTART;
+}
+
+/*
+ * drm_crtc_send_vblank_event() stamps the event with the last vblank, this
+ * uses the time the frame is on the panel instead.
+ */
+static void tinydrm_flush_send_event(struct tinydrm_flush *flush,
+				     struct drm_pending_vblank_event *event, ktime_t time)
+{
+	struct drm_crtc *crtc = flush->crtc;
+	struct drm_device *drm = crtc->dev;
+	struct timespec64 tv;
+
+	if (flush->present)
+		time = flush->present(flush, time);
+	tv = ktime_to_timespec64(time);
+
+	spin_lock_irq(&drm->event_lock);
+	event->event.vbl.sequence = drm_crtc_vblank_count(crtc);
+	event->event.vbl.tv_sec = tv.tv_sec;
+	event->event.vbl.tv_usec = tv.tv_nsec / NSEC_PER_USEC;
+	drm_send_event_locked(drm, &event->base);
+	spin_unlock_irq(&drm->event_lock);
+}
+
+/**
+ * tinydrm_flush_init - Initialize flush worker
+ * @flush: Flush worker
+ * @crtc: CRTC the page flip events are sent on
+ * @func: Called from the worker to send the damage clips
+ */
+void tinydrm_flush_init(struct tinydrm_flush *flush, struct drm_crtc *crtc,
+			tinydrm_flush_func func)
+{
+	spin_lock_init(&flush->lock);
+	INIT_WORK(&flush->work, tinydrm_flush_work);
+	hrtimer_init(&flush->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	flush->timer.function = tinydrm_flush_timer;
+	hrtimer_init(&flush->vblank_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	flush->vblank_timer.function = tinydrm_flush_vblank_timer;
+	flush->crtc = crtc;
+	flush->func = func;
+}
+EXPORT_SYMBOL(tinydrm_flush_init);
+
+/**
+ * tinydrm_flush_latch - Release the framebuffer being flushed
+ * @flush: Flush worker
+ * @remaining_ns: How long it will take to send what's left of the frame
+ *
+ * The flush function calls this when it's done reading the framebuffer and
+ * only its own buffers are left to send. This sends the page flip event
+ * stamped with the expected completion time. The worker calls it when the
+ * flush function returns if the driver hasn't, then the time is exact.
+ */
+void tinydrm_flush_latch(struct tinydrm_flush *flush, u64 remaining_ns)
+{
+	struct drm_pending_vblank_event *event = flush->latch_event;
+
+	flush->latch_event = NULL;
+	if (event)
+		tinydrm_flush_send_event(flush, event, ktime_add_ns(ktime_get(), remaining_ns));
+}
+EXPORT_SYMBOL(tinydrm_flush_latch);
+
+/**
+ * tinydrm_flush_set_fps - Set frame rate cap
+ * @flush: Flush worker
+ * @fps: Maximum number of flushes per second, zero means no limit
+ */
+void tinydrm_flush_set_fps(struct tinydrm_flush *flush, unsigned int fps)
+{
+	spin_lock(&flush->lock);
+	WRITE_ONCE(flush->fps, fps);
+	spin_unlock(&flush->lock);
+}
+EXPORT_SYMBOL(tinydrm_flush_set_fps);
+
+/**
+ * tinydrm_flush_vblank_init - Initialize vblank emulation
+ * @flush: Flush worker
+ *
+ * Initializes vblank support for the device, the flush CRTC has to be its
+ * only CRTC. The driver calls tinydrm_flush_enable_vblank() and
+ * tinydrm_flush_disable_vblank() from its vblank callbacks and
+ * drm_crtc_vblank_on() and drm_crtc_vblank_off() when the pipe is enabled and
+ * disabled.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_flush_vblank_init(struct tinydrm_flush *flush)
+{
+	flush->vblank = true;
+
+	return drm_vblank_init(flush->crtc->dev, 1);
+}
+EXPORT_SYMBOL(tinydrm_flush_vblank_init);
+
+/**
+ * tinydrm_flush_enable_vblank - Start vblank timer
+ * @flush: Flush worker
+ *
+ * Returns:
+ * Zero.
+ */
+int tinydrm_flush_enable_vblank(struct tinydrm_flush *flush)
+{
+	hrtimer_start(&flush->vblank_timer, ns_to_ktime(tinydrm_flush_vblank_period(flush)),
+		      HRTIMER_MODE_REL);
+
+	return 0;
+}
+EXPORT_SYMBOL(tinydrm_flush_enable_vblank);
+
+/**
+ * tinydrm_flush_disable_vblank - Stop vblank timer
+ * @flush: Flush worker
+ */
+void tinydrm_flush_disable_vblank(struct tinydrm_flush *flush)
+{
+	/* Can't wait here, the timer stops by itself once vblank is off */
+	hrtimer_try_to_cancel(&flush->vblank_timer);
+}
+EXPORT_SYMBOL(tinydrm_flush_disable_vblank);
+
+/**
+ * tinydrm_mode_set_bus_clock - Set mode clock from the bus clock
+ * @mode: Display mode
+ * @bus_hz: Bus clock for pixel data
+ * @bits_per_pixel: Bits on the bus per pixel
+ *
+ * The display has its own memory and refreshes from that, so the rate
+ * userspace can update it at is the rate pixels can be sent. This sets the
+ * mode clock and refresh rate to match.
+ */
+void tinydrm_mode_set_bus_clock(struct drm_display_mode *mode, u32 bus_hz,
+				unsigned int bits_per_pixel)
+{
+	mode->clock = max_t(u32, bus_hz / bits_per_pixel / 1000, 1);
+	mode->vrefresh = 0;
+	mode->vrefresh = drm_mode_vrefresh(mode);
+}
+EXPORT_SYMBOL(tinydrm_mode_set_bus_clock);
+
+static void tinydrm_flush_add_clip(struct tinydrm_flush *flush, struct drm_rect *clip)
+{
+	struct drm_rect *merged = &flush->clips[0];
+	unsigned int i;
+
+	if (flush->num_clips < TINYDRM_FLUSH_MAX_CLIPS) {
+		flush->clips[flush->num_clips++] = *clip;
+		return;
+	}
+
+	/* Out of slots, fall back to one rectangle covering everything */
+	for (i = 1; i < flush->num_clips; i++) {
+		merged->x1 = min(merged->x1, flush->clips[i].x1);
+		merged->y1 = min(merged->y1, flush->clips[i].y1);
+		merged->x2 = max(merged->x2, flush->clips[i].x2);
+		merged->y2 = max(merged->y2, flush->clips[i].y2);
+	}
+	merged->x1 = min(merged->x1, clip->x1);
+	merged->y1 = min(merged->y1, clip->y1);
+	merged->x2 = max(merged->x2, clip->x2);
+	merged->y2 = max(merged->y2, clip->y2);
+	flush->num_clips = 1;
+}
+
+/**
+ * tinydrm_flush_queue - Queue plane damage for flushing
+ * @flush: Flush worker
+ * @old_state: Old plane state
+ * @state: New plane state
+ *
+ * Call this from the &drm_simple_display_pipe_funcs.update callback. The
+ * framebuffer is kept alive until the worker is done with it and the CRTC
+ * event goes with it. The event is sent right away if there's no damage.
+ */
+void tinydrm_flush_queue(struct tinydrm_flush *flush, struct drm_plane_state *old_state,
+			 struct drm_plane_state *state)
+{
+	struct drm_pending_vblank_event *event = flush->crtc->state->event;
+	struct drm_atomic_helper_damage_iter iter;
+	struct drm_pending_vblank_event *old_event = NULL;
+	struct drm_framebuffer *old_fb = NULL;
+	bool damage = false, running = false;
+	ktime_t next = 0;
+	struct drm_rect clip;
+
+	flush->crtc->state->event = NULL;
+
+	if (state->fb && flush->crtc->state->active) {
+		drm_atomic_helper_damage_iter_init(&iter, old_state, state);
+
+		spin_lock(&flush->lock);
+		drm_atomic_for_each_plane_damage(&iter, &clip) {
+			tinydrm_flush_add_clip(flush, &clip);
+			damage = true;
+		}
+
+		if (damage) {
+			drm_framebuffer_get(state->fb);
+			old_fb = flush->fb;
+			old_event = flush->event;
+			if (old_fb)
+				flush->dropped++;
+			flush->fb = state->fb;
+			flush->event = event;
+			event = NULL;
+			flush->queued++;
+			if (flush->fps)
+				next = ktime_add_ns(flush->last, div_u64(NSEC_PER_SEC, flush->fps));
+		}
+		running = flush->running;
+		spin_unlock(&flush->lock);
+	}
+
+	if (old_fb)
+		drm_framebuffer_put(old_fb);
+	if (old_event)
+		tinydrm_flush_send_event(flush, old_event, ktime_get());
+	if (event)
+		tinydrm_flush_send_event(flush, event, ktime_get());
+
+	if (!damage || !running)
+		return;
+
+	if (ktime_after(next, ktime_get()))
+		hrtimer_start(&flush->timer, next, HRTIMER_MODE_ABS);
+	else
+		queue_work(system_highpri_wq, &flush->work);
+}
+EXPORT_SYMBOL(tinydrm_flush_queue);
+
+/**
+ * tinydrm_flush_start - Start flush worker
+ * @flush: Flush worker
+ * @fb: Framebuffer
+ *
+ * Call this when the pipe is enabled. The worker flushes all of @fb and this
+ * waits for it to finish. A pending frame is replaced, its event goes with
+ * @fb.
+ */
+void tinydrm_flush_start(struct tinydrm_flush *flush, struct drm_framebuffer *fb)
+{
+	struct drm_rect clip = {
+		.x1 = 0,
+		.x2 = fb->width,
+		.y1 = 0,
+		.y2 = fb->height,
+	};
+	struct drm_framebuffer *old_fb;
+
+	drm_framebuffer_get(fb);
+
+	spin_lock(&flush->lock);
+	old_fb = flush->fb;
+	if (old_fb)
+		flush->dropped++;
+	flush->fb = fb;
+	flush->clips[0] = clip;
+	flush->num_clips = 1;
+	flush->queued++;
+	flush->running = true;
+	spin_unlock(&flush->lock);
+
+	if (old_fb)
+		drm_framebuffer_put(old_fb);
+
+	queue_work(system_highpri_wq, &flush->work);
+	flush_work(&flush->work);
+}
+EXPORT_SYMBOL(tinydrm_flush_start);
+
+/**
+ * tinydrm_flush_stop - Stop flush worker
+ * @flush: Flush worker
+ *
+ * Drops a pending frame, sending its event, and waits for a running flush to
+ * finish. Call this before turning off the display and after
+ * drm_crtc_vblank_off().
+ */
+void tinydrm_flush_stop(struct tinydrm_flush *flush)
+{
+	struct drm_pending_vblank_event *event;
+	struct drm_framebuffer *fb;
+
+	spin_lock(&flush->lock);
+	fb = flush->fb;
+	event = flush->event;
+	if (fb)
+		flush->dropped++;
+	flush->fb = NULL;
+	flush->event = NULL;
+	flush->num_clips = 0;
+	flush->running = false;
+	spin_unlock(&flush->lock);
+
+	if (fb)
+		drm_framebuffer_put(fb);
+	if (event)
+		tinydrm_flush_send_event(flush, event, ktime_get());
+
+	hrtimer_cancel(&flush->timer);
+	cancel_work_sync(&flush->work);
+	hrtimer_cancel(&flush->vblank_timer);
+}
+EXPORT_SYMBOL(tinydrm_flush_stop);
+
+static int tinydrm_flush_debugfs_show(struct seq_file *m, void *d)
+{
+	struct tinydrm_flush *flush = m->private;
+	u64 queued, flushed, dropped;
+
+	spin_lock(&flush->lock);
+	queued = flush->queued;
+	flushed = flush->flushed;
+	dropped = flush->dropped;
+	spin_unlock(&flush->lock);
+
+	seq_printf(m, "queued: %llu\n", queued);
+	seq_printf(m, "flushed: %llu\n", flushed);
+	seq_printf(m, "dropped: %llu\n", dropped);
+	seq_printf(m, "flush time: %llu us\n", div_u64(READ_ONCE(flush->flush_ns), 1000));
+	if (flush->vblank)
+		seq_printf(m, "vblank period: %llu us\n",
+			   div_u64(tinydrm_flush_vblank_period(flush), 1000));
+
+	return 0;
+}
+
+static int tinydrm_flush_debugfs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tinydrm_flush_debugfs_show, inode->i_private);
+}
+
+static const struct file_operations tinydrm_flush_debugfs_fops = {
+	.owner = THIS_MODULE,
+	.open = tinydrm_flush_debugfs_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int tinydrm_flush_fps_get(void *data, u64 *val)
+{
+	struct tinydrm_flush *flush = data;
+
+	*val = flush->fps;
+
+	return 0;
+}
+
+static int tinydrm_flush_fps_set(void *data, u64 val)
+{
+	if (val > 1000)
+		return -EINVAL;
+
+	tinydrm_flush_set_fps(data, val);
+
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(tinydrm_flush_fps_fops, tinydrm_flush_fps_get,
+			 tinydrm_flush_fps_set, "%llu\n");
+
+/**
+ * tinydrm_flush_debugfs_init - Create debugfs files for the flush worker
+ * @flush: Flush worker
+ * @root: debugfs directory
+ *
+ * 'flush' has the frame counters and 'fps' sets the frame rate cap.
+ */
+void tinydrm_flush_debugfs_init(struct tinydrm_flush *flush, struct dentry *root)
+{
+	debugfs_create_file("flush", S_IFREG | S_IRUGO, root, flush,
+			    &tinydrm_flush_debugfs_fops);
+	debugfs_create_file_unsafe("fps", S_IFREG | S_IRUGO | S_IWUSR, root, flush,
+				   &tinydrm_flush_fps_fops);
+}
+EXPORT_SYMBOL(tinydrm_flush_debugfs_init);
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * NEON pixel conversion kernels
+ *
+ * Copyright 2020 Noralf Trønnes
+ *
+ * Built with NEON enabled so it can't call kernel_neon_begin() itself, see
+ * tinydrm-format-neon.c. The pixel count is a multiple of 8, a multiple of
+ * the tile size for the diff.
+ */
+
+#include <asm/neon-intrinsics.h>
+
+#include "tinydrm-format.h"
+
+/* XRGB8888 is B, G, R, X in memory */
+static inline uint16x8_t tinydrm_rgb565_neon(uint8x8x4_t pix)
+{
+	uint16x8_t out;
+
+	out = vshll_n_u8(pix.val[2], 8);
+	out = vsriq_n_u16(out, vshll_n_u8(pix.val[1], 8), 5);
+	out = vsriq_n_u16(out, vshll_n_u8(pix.val[0], 8), 11);
+
+	return out;
+}
+
+void tinydrm_swab16_neon_inner(u16 *dst, const u16 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i += 8)
+		vst1q_u8((u8 *)&dst[i], vrev16q_u8(vld1q_u8((const u8 *)&src[i])));
+}
+
+void tinydrm_xrgb8888_to_rgb565_neon_inner(u16 *dst, const u32 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i += 8) {
+		uint16x8_t out = tinydrm_rgb565_neon(vld4_u8((const u8 *)&src[i]));
+
+		vst1q_u8((u8 *)&dst[i], vreinterpretq_u8_u16(out));
+	}
+}
+
+void tinydrm_xrgb8888_to_rgb565_swab_neon_inner(u16 *dst, const u32 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i += 8) {
+		uint16x8_t out = tinydrm_rgb565_neon(vld4_u8((const u8 *)&src[i]));
+
+		vst1q_u8((u8 *)&dst[i], vrev16q_u8(vreinterpretq_u8_u16(out)));
+	}
+}
+
+u32 tinydrm_diff_tiles_neon_inner(const u16 *a, const u16 *b, unsigned int n)
+{
+	unsigned int i, t;
+	u32 mask = 0;
+
+	for (i = 0, t = 0; i < n; i += TINYDRM_TILE_SIZE, t++) {
+		uint16x8_t lo = veorq_u16(vld1q_u16(&a[i]), vld1q_u16(&b[i]));
+		uint16x8_t hi = veorq_u16(vld1q_u16(&a[i + 8]), vld1q_u16(&b[i + 8]));
+		uint64x2_t x = vreinterpretq_u64_u16(vorrq_u16(lo, hi));
+
+		if (vgetq_lane_u64(x, 0) | vgetq_lane_u64(x, 1))
+			mask |= 1U << t;
+	}
+
+	return mask;
+}
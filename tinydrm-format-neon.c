@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * NEON pixel conversion
+ *
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#include <linux/kernel.h>
+#include <linux/swab.h>
+#include <asm/neon.h>
+#include <asm/unaligned.h>
+
+#include "tinydrm-format.h"
+
+static bool tinydrm_neon_supported(void)
+{
+	return cpu_has_neon();
+}
+
+static void tinydrm_neon_begin(void)
+{
+	kernel_neon_begin();
+}
+
+static void tinydrm_neon_end(void)
+{
+	kernel_neon_end();
+}
+
+static void tinydrm_swab16_neon(u16 *dst, const u16 *src, unsigned int n)
+{
+	unsigned int i = round_down(n, 8);
+
+	tinydrm_swab16_neon_inner(dst, src, i);
+
+	for (; i < n; i++)
+		put_unaligned(swab16(src[i]), &dst[i]);
+}
+
+static void tinydrm_xrgb8888_to_rgb565_neon(u16 *dst, const u32 *src, unsigned int n)
+{
+	unsigned int i = round_down(n, 8);
+
+	tinydrm_xrgb8888_to_rgb565_neon_inner(dst, src, i);
+
+	for (; i < n; i++)
+		put_unaligned(tinydrm_xrgb8888_to_rgb565_pixel(src[i]), &dst[i]);
+}
+
+static void tinydrm_xrgb8888_to_rgb565_swab_neon(u16 *dst, const u32 *src, unsigned int n)
+{
+	unsigned int i = round_down(n, 8);
+
+	tinydrm_xrgb8888_to_rgb565_swab_neon_inner(dst, src, i);
+
+	for (; i < n; i++)
+		put_unaligned(swab16(tinydrm_xrgb8888_to_rgb565_pixel(src[i])), &dst[i]);
+}
+
+static u32 tinydrm_diff_tiles_neon(const u16 *a, const u16 *b, unsigned int n)
+{
+	unsigned int i = round_down(n, TINYDRM_TILE_SIZE);
+	u32 mask;
+
+	mask = tinydrm_diff_tiles_neon_inner(a, b, i);
+
+	if (i < n && tinydrm_pixels_differ(a + i, b + i, n - i))
+		mask |= BIT(i / TINYDRM_TILE_SIZE);
+
+	return mask;
+}
+
+const struct tinydrm_format_impl tinydrm_format_neon = {
+	.name = "neon",
+	.supported = tinydrm_neon_supported,
+	.begin = tinydrm_neon_begin,
+	.end = tinydrm_neon_end,
+	.swab = tinydrm_swab16_neon,
+	.xrgb8888_to_rgb565 = tinydrm_xrgb8888_to_rgb565_neon,
+	.xrgb8888_to_rgb565_swab = tinydrm_xrgb8888_to_rgb565_swab_neon,
+	.diff_tiles = tinydrm_diff_tiles_neon,
+};
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * SSE2 and AVX2 pixel conversion kernels
+ *
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#include <linux/kernel.h>
+#include <linux/swab.h>
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#include <asm/unaligned.h>
+
+#include "tinydrm-format.h"
+
+/*
+ * The asm statements list every vector register they touch as clobbered, the
+ * xmm names also cover the ymm registers. The kernel is normally built without
+ * SSE, then the compiler never keeps values in them and refuses the clobbers.
+ */
+#ifdef __SSE__
+#define VEC_CLOBBERS(...)	__VA_ARGS__
+#else
+#define VEC_CLOBBERS(...)
+#endif
+
+/* Per lane masks for the red, green and blue bits after shifting */
+static const u32 tinydrm_rgb565_masks[3][8] __aligned(32) = {
+	{ 0xf800, 0xf800, 0xf800, 0xf800, 0xf800, 0xf800, 0xf800, 0xf800 },
+	{ 0x07e0, 0x07e0, 0x07e0, 0x07e0, 0x07e0, 0x07e0, 0x07e0, 0x07e0 },
+	{ 0x001f, 0x001f, 0x001f, 0x001f, 0x001f, 0x001f, 0x001f, 0x001f },
+};
+
+/*
+ * Convert the XRGB8888 pixels in @reg to RGB565 in the low half of each 32-bit
+ * lane and sign extend it so packssdw can't saturate. Uses xmm1 and xmm2.
+ */
+#define SSE2_RGB565(reg)					\
+	"movdqa " reg ", %%xmm1\n\t"				\
+	"psrld $8, %%xmm1\n\t"					\
+	"pand %[mr], %%xmm1\n\t"				\
+	"movdqa " reg ", %%xmm2\n\t"				\
+	"psrld $5, %%xmm2\n\t"					\
+	"pand %[mg], %%xmm2\n\t"				\
+	"por %%xmm2, %%xmm1\n\t"				\
+	"psrld $3, " reg "\n\t"					\
+	"pand %[mb], " reg "\n\t"				\
+	"por %%xmm1, " reg "\n\t"				\
+	"pslld $16, " reg "\n\t"				\
+	"psrad $16, " reg "\n\t"
+
+/* Swap the bytes of the 16-bit words in xmm0. Uses xmm1. */
+#define SSE2_SWAB16						\
+	"movdqa %%xmm0, %%xmm1\n\t"				\
+	"psllw $8, %%xmm0\n\t"					\
+	"psrlw $8, %%xmm1\n\t"					\
+	"por %%xmm1, %%xmm0\n\t"
+
+#define AVX2_RGB565(reg)					\
+	"vpsrld $8, " reg ", %%ymm1\n\t"			\
+	"vpand %[mr], %%ymm1, %%ymm1\n\t"			\
+	"vpsrld $5, " reg ", %%ymm2\n\t"			\
+	"vpand %[mg], %%ymm2, %%ymm2\n\t"			\
+	"vpor %%ymm2, %%ymm1, %%ymm1\n\t"			\
+	"vpsrld $3, " reg ", " reg "\n\t"			\
+	"vpand %[mb], " reg ", " reg "\n\t"			\
+	"vpor %%ymm1, " reg ", " reg "\n\t"			\
+	"vpslld $16, " reg ", " reg "\n\t"			\
+	"vpsrad $16, " reg ", " reg "\n\t"
+
+#define AVX2_SWAB16						\
+	"vpsllw $8, %%ymm0, %%ymm1\n\t"				\
+	"vpsrlw $8, %%ymm0, %%ymm0\n\t"				\
+	"vpor %%ymm1, %%ymm0, %%ymm0\n\t"
+
+/* Packing works within 128-bit lanes, put the quadwords back in order */
+#define AVX2_PACK						\
+	"vpackssdw %%ymm3, %%ymm0, %%ymm0\n\t"			\
+	"vpermq $0xd8, %%ymm0, %%ymm0\n\t"
+
+#define RGB565_MASKS						\
+	[mr] "m" (tinydrm_rgb565_masks[0]),			\
+	[mg] "m" (tinydrm_rgb565_masks[1]),			\
+	[mb] "m" (tinydrm_rgb565_masks[2])
+
+static void tinydrm_swab16_tail(u16 *dst, const u16 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		put_unaligned(swab16(src[i]), &dst[i]);
+}
+
+static void tinydrm_xrgb8888_to_rgb565_tail(u16 *dst, const u32 *src,
+					    unsigned int n, bool swab)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		u16 val = tinydrm_xrgb8888_to_rgb565_pixel(src[i]);
+
+		put_unaligned(swab ? swab16(val) : val, &dst[i]);
+	}
+}
+
+static bool tinydrm_sse2_supported(void)
+{
+	return boot_cpu_has(X86_FEATURE_XMM2);
+}
+
+static void tinydrm_x86_begin(void)
+{
+	kernel_fpu_begin();
+}
+
+static void tinydrm_x86_end(void)
+{
+	kernel_fpu_end();
+}
+
+static void tinydrm_swab16_sse2(u16 *dst, const u16 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		asm volatile("movdqu %[s], %%xmm0\n\t"
+			     SSE2_SWAB16
+			     "movdqu %%xmm0, %[d]\n\t"
+			     : [d] "=m" (*(u8 (*)[16])&dst[i])
+			     : [s] "m" (*(const u8 (*)[16])&src[i])
+			     : VEC_CLOBBERS("xmm0", "xmm1"));
+
+	tinydrm_swab16_tail(dst + i, src + i, n - i);
+}
+
+static void tinydrm_xrgb8888_to_rgb565_sse2(u16 *dst, const u32 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		asm volatile("movdqu %[s0], %%xmm0\n\t"
+			     "movdqu %[s1], %%xmm3\n\t"
+			     SSE2_RGB565("%%xmm0")
+			     SSE2_RGB565("%%xmm3")
+			     "packssdw %%xmm3, %%xmm0\n\t"
+			     "movdqu %%xmm0, %[d]\n\t"
+			     : [d] "=m" (*(u8 (*)[16])&dst[i])
+			     : [s0] "m" (*(const u8 (*)[16])&src[i]),
+			       [s1] "m" (*(const u8 (*)[16])&src[i + 4]),
+			       RGB565_MASKS
+			     : VEC_CLOBBERS("xmm0", "xmm1", "xmm2", "xmm3"));
+
+	tinydrm_xrgb8888_to_rgb565_tail(dst + i, src + i, n - i, false);
+}
+
+static void tinydrm_xrgb8888_to_rgb565_swab_sse2(u16 *dst, const u32 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		asm volatile("movdqu %[s0], %%xmm0\n\t"
+			     "movdqu %[s1], %%xmm3\n\t"
+			     SSE2_RGB565("%%xmm0")
+			     SSE2_RGB565("%%xmm3")
+			     "packssdw %%xmm3, %%xmm0\n\t"
+			     SSE2_SWAB16
+			     "movdqu %%xmm0, %[d]\n\t"
+			     : [d] "=m" (*(u8 (*)[16])&dst[i])
+			     : [s0] "m" (*(const u8 (*)[16])&src[i]),
+			       [s1] "m" (*(const u8 (*)[16])&src[i + 4]),
+			       RGB565_MASKS
+			     : VEC_CLOBBERS("xmm0", "xmm1", "xmm2", "xmm3"));
+
+	tinydrm_xrgb8888_to_rgb565_tail(dst + i, src + i, n - i, true);
+}
+
+static u32 tinydrm_diff_tiles_sse2(const u16 *a, const u16 *b, unsigned int n)
+{
+	unsigned int i, t, eq;
+	u32 mask = 0;
+
+	for (i = 0, t = 0; i + TINYDRM_TILE_SIZE <= n; i += TINYDRM_TILE_SIZE, t++) {
+		asm volatile("movdqu %[a0], %%xmm0\n\t"
+			     "movdqu %[a1], %%xmm1\n\t"
+			     "movdqu %[b0], %%xmm2\n\t"
+			     "movdqu %[b1], %%xmm3\n\t"
+			     "pcmpeqb %%xmm2, %%xmm0\n\t"
+			     "pcmpeqb %%xmm3, %%xmm1\n\t"
+			     "pand %%xmm1, %%xmm0\n\t"
+			     "pmovmskb %%xmm0, %[eq]\n\t"
+			     : [eq] "=r" (eq)
+			     : [a0] "m" (*(const u8 (*)[16])&a[i]),
+			       [a1] "m" (*(const u8 (*)[16])&a[i + 8]),
+			       [b0] "m" (*(const u8 (*)[16])&b[i]),
+			       [b1] "m" (*(const u8 (*)[16])&b[i + 8])
+			     : VEC_CLOBBERS("xmm0", "xmm1", "xmm2", "xmm3"));
+		if (eq != 0xffff)
+			mask |= BIT(t);
+	}
+
+	if (i < n && tinydrm_pixels_differ(a + i, b + i, n - i))
+		mask |= BIT(t);
+
+	return mask;
+}
+
+const struct tinydrm_format_impl tinydrm_format_sse2 = {
+	.name = "sse2",
+	.supported = tinydrm_sse2_supported,
+	.begin = tinydrm_x86_begin,
+	.end = tinydrm_x86_end,
+	.swab = tinydrm_swab16_sse2,
+	.xrgb8888_to_rgb565 = tinydrm_xrgb8888_to_rgb565_sse2,
+	.xrgb8888_to_rgb565_swab = tinydrm_xrgb8888_to_rgb565_swab_sse2,
+	.diff_tiles = tinydrm_diff_tiles_sse2,
+};
+
+/* Only if the assembler knows AVX2, see Kbuild */
+#ifdef TINYDRM_AS_AVX2
+static bool tinydrm_avx2_supported(void)
+{
+	return boot_cpu_has(X86_FEATURE_AVX) && boot_cpu_has(X86_FEATURE_AVX2);
+}
+
+static void tinydrm_swab16_avx2(u16 *dst, const u16 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+		asm volatile("vmovdqu %[s], %%ymm0\n\t"
+			     AVX2_SWAB16
+			     "vmovdqu %%ymm0, %[d]\n\t"
+			     : [d] "=m" (*(u8 (*)[32])&dst[i])
+			     : [s] "m" (*(const u8 (*)[32])&src[i])
+			     : VEC_CLOBBERS("xmm0", "xmm1"));
+
+	asm volatile("vzeroupper");
+
+	tinydrm_swab16_tail(dst + i, src + i, n - i);
+}
+
+static void tinydrm_xrgb8888_to_rgb565_avx2(u16 *dst, const u32 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+		asm volatile("vmovdqu %[s0], %%ymm0\n\t"
+			     "vmovdqu %[s1], %%ymm3\n\t"
+			     AVX2_RGB565("%%ymm0")
+			     AVX2_RGB565("%%ymm3")
+			     AVX2_PACK
+			     "vmovdqu %%ymm0, %[d]\n\t"
+			     : [d] "=m" (*(u8 (*)[32])&dst[i])
+			     : [s0] "m" (*(const u8 (*)[32])&src[i]),
+			       [s1] "m" (*(const u8 (*)[32])&src[i + 8]),
+			       RGB565_MASKS
+			     : VEC_CLOBBERS("xmm0", "xmm1", "xmm2", "xmm3"));
+
+	asm volatile("vzeroupper");
+
+	tinydrm_xrgb8888_to_rgb565_tail(dst + i, src + i, n - i, false);
+}
+
+static void tinydrm_xrgb8888_to_rgb565_swab_avx2(u16 *dst, const u32 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+		asm volatile("vmovdqu %[s0], %%ymm0\n\t"
+			     "vmovdqu %[s1], %%ymm3\n\t"
+			     AVX2_RGB565("%%ymm0")
+			     AVX2_RGB565("%%ymm3")
+			     AVX2_PACK
+			     AVX2_SWAB16
+			     "vmovdqu %%ymm0, %[d]\n\t"
+			     : [d] "=m" (*(u8 (*)[32])&dst[i])
+			     : [s0] "m" (*(const u8 (*)[32])&src[i]),
+			       [s1] "m" (*(const u8 (*)[32])&src[i + 8]),
+			       RGB565_MASKS
+			     : VEC_CLOBBERS("xmm0", "xmm1", "xmm2", "xmm3"));
+
+	asm volatile("vzeroupper");
+
+	tinydrm_xrgb8888_to_rgb565_tail(dst + i, src + i, n - i, true);
+}
+
+static u32 tinydrm_diff_tiles_avx2(const u16 *a, const u16 *b, unsigned int n)
+{
+	unsigned int i, t, eq;
+	u32 mask = 0;
+
+	for (i = 0, t = 0; i + TINYDRM_TILE_SIZE <= n; i += TINYDRM_TILE_SIZE, t++) {
+		asm volatile("vmovdqu %[a], %%ymm0\n\t"
+			     "vpcmpeqb %[b], %%ymm0, %%ymm0\n\t"
+			     "vpmovmskb %%ymm0, %[eq]\n\t"
+			     : [eq] "=r" (eq)
+			     : [a] "m" (*(const u8 (*)[32])&a[i]),
+			       [b] "m" (*(const u8 (*)[32])&b[i])
+			     : VEC_CLOBBERS("xmm0"));
+		if (eq != 0xffffffff)
+			mask |= BIT(t);
+	}
+
+	asm volatile("vzeroupper");
+
+	if (i < n && tinydrm_pixels_differ(a + i, b + i, n - i))
+		mask |= BIT(t);
+
+	return mask;
+}
+
+const struct tinydrm_format_impl tinydrm_format_avx2 = {
+	.name = "avx2",
+	.supported = tinydrm_avx2_supported,
+	.begin = tinydrm_x86_begin,
+	.end = tinydrm_x86_end,
+	.swab = tinydrm_swab16_avx2,
+	.xrgb8888_to_rgb565 = tinydrm_xrgb8888_to_rgb565_avx2,
+	.xrgb8888_to_rgb565_swab = tinydrm_xrgb8888_to_rgb565_swab_avx2,
+	.diff_tiles = tinydrm_diff_tiles_avx2,
+};
+
+#endif
@@ -0,0 +1,502 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Pixel format conversion for the tiny DRM drivers
+ *
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/swab.h>
+#include <asm/simd.h>
+#include <asm/unaligned.h>
+
+#include <drm/drm_format_helper.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_rect.h>
+
+#include "tinydrm-format.h"
+#include "tinydrm-helpers.h"
+
+static bool simd = true;
+module_param(simd, bool, 0444);
+MODULE_PARM_DESC(simd, "Use vectorized conversion if the CPU supports it (default: true)");
+
+/*
+ * Pixels per kernel call. The source is copied to a cached per-CPU buffer
+ * first since reading write-combined memory a pixel at a time is slow. This
+ * also bounds the time spent with preemption disabled, both for the buffer and
+ * by the SIMD kernels.
+ */
+#define TINYDRM_CONV_PIXELS	1024
+
+/* Room for %TINYDRM_CONV_PIXELS XRGB8888 pixels */
+static void __percpu *tinydrm_conv_sbuf;
+
+static void tinydrm_swab16_scalar(u16 *dst, const u16 *src, unsigned int n)
+{
+	unsigned int i;
+
+	/* Two pixels at a time */
+	for (i = 0; i + 2 <= n; i += 2) {
+		u32 val = get_unaligned((const u32 *)&src[i]);
+
+		put_unaligned(((val & 0x00ff00ff) << 8) | ((val >> 8) & 0x00ff00ff),
+			      (u32 *)&dst[i]);
+	}
+
+	if (i < n)
+		put_unaligned(swab16(src[i]), &dst[i]);
+}
+
+static void tinydrm_xrgb8888_to_rgb565_scalar(u16 *dst, const u32 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		put_unaligned(tinydrm_xrgb8888_to_rgb565_pixel(src[i]), &dst[i]);
+}
+
+static void tinydrm_xrgb8888_to_rgb565_swab_scalar(u16 *dst, const u32 *src, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		put_unaligned(swab16(tinydrm_xrgb8888_to_rgb565_pixel(src[i])), &dst[i]);
+}
+
+static u32 tinydrm_diff_tiles_scalar(const u16 *a, const u16 *b, unsigned int n)
+{
+	unsigned int i, t;
+	u32 mask = 0;
+
+	for (i = 0, t = 0; i < n; i += TINYDRM_TILE_SIZE, t++)
+		if (tinydrm_pixels_differ(a + i, b + i,
+					  min_t(unsigned int, n - i, TINYDRM_TILE_SIZE)))
+			mask |= BIT(t);
+
+	return mask;
+}
+
+static const struct tinydrm_format_impl tinydrm_format_scalar = {
+	.name = "scalar",
+	.swab = tinydrm_swab16_scalar,
+	.xrgb8888_to_rgb565 = tinydrm_xrgb8888_to_rgb565_scalar,
+	.xrgb8888_to_rgb565_swab = tinydrm_xrgb8888_to_rgb565_swab_scalar,
+	.diff_tiles = tinydrm_diff_tiles_scalar,
+};
+
+/* Fastest first */
+static const struct tinydrm_format_impl * const tinydrm_format_impls[] = {
+#ifdef CONFIG_KERNEL_MODE_NEON
+	&tinydrm_format_neon,
+#endif
+#ifdef CONFIG_X86
+#ifdef TINYDRM_AS_AVX2
+	&tinydrm_format_avx2,
+#endif
+	&tinydrm_format_sse2,
+#endif
+};
+
+static const struct tinydrm_format_impl *tinydrm_format_simd;
+
+static const struct tinydrm_format_impl *tinydrm_format_get(void)
+{
+	if (!tinydrm_format_simd || !may_use_simd())
+		return &tinydrm_format_scalar;
+
+	return tinydrm_format_simd;
+}
+
+enum tinydrm_conv_op {
+	TINYDRM_CONV_SWAB16,
+	TINYDRM_CONV_XRGB8888_TO_RGB565,
+	TINYDRM_CONV_XRGB8888_TO_RGB565_SWAB,
+};
+
+static void tinydrm_conv_run(const struct tinydrm_format_impl *impl,
+			     enum tinydrm_conv_op op, void *dst, const void *src,
+			     unsigned int n)
+{
+	if (impl->begin)
+		impl->begin();
+
+	switch (op) {
+	case TINYDRM_CONV_SWAB16:
+		impl->swab(dst, src, n);
+		break;
+	case TINYDRM_CONV_XRGB8888_TO_RGB565:
+		impl->xrgb8888_to_rgb565(dst, src, n);
+		break;
+	case TINYDRM_CONV_XRGB8888_TO_RGB565_SWAB:
+		impl->xrgb8888_to_rgb565_swab(dst, src, n);
+		break;
+	}
+
+	if (impl->end)
+		impl->end();
+}
+
+static u32 tinydrm_diff_run(const struct tinydrm_format_impl *impl,
+			    const u16 *a, const u16 *b, unsigned int n)
+{
+	u32 mask;
+
+	if (impl->begin)
+		impl->begin();
+
+	mask = impl->diff_tiles(a, b, n);
+
+	if (impl->end)
+		impl->end();
+
+	return mask;
+}
+
+/*
+ * Convert @pixels pixels at a time through the staging buffer. Runs are either
+ * lines or the whole clip when it covers full lines without padding.
+ */
+static void tinydrm_conv_lines(const struct tinydrm_format_impl *impl,
+			       enum tinydrm_conv_op op, void *dst, const void *src,
+			       unsigned int src_pitch, unsigned int cpp,
+			       unsigned int pixels, unsigned int lines)
+{
+	unsigned int y, n, left;
+	void *sbuf;
+
+	if (src_pitch == pixels * cpp) {
+		pixels *= lines;
+		lines = 1;
+	}
+
+	for (y = 0; y < lines; y++) {
+		const void *s = src + y * src_pitch;
+
+		for (left = pixels; left; left -= n) {
+			n = min_t(unsigned int, left, TINYDRM_CONV_PIXELS);
+			sbuf = get_cpu_ptr(tinydrm_conv_sbuf);
+			memcpy(sbuf, s, n * cpp);
+			tinydrm_conv_run(impl, op, dst, sbuf, n);
+			put_cpu_ptr(tinydrm_conv_sbuf);
+			s += n * cpp;
+			dst += n * sizeof(u16);
+		}
+	}
+}
+
+static int tinydrm_fb_convert(void *dst, void *vaddr, struct drm_framebuffer *fb,
+			      struct drm_rect *clip, bool swap,
+			      const struct tinydrm_format_impl *impl)
+{
+	unsigned int width = drm_rect_width(clip);
+	unsigned int height = drm_rect_height(clip);
+	unsigned int cpp = fb->format->cpp[0];
+	enum tinydrm_conv_op op;
+	unsigned int y;
+	void *src;
+
+	src = vaddr + fb->offsets[0] + clip->y1 * fb->pitches[0] + clip->x1 * cpp;
+
+	switch (fb->format->format) {
+	case DRM_FORMAT_RGB565:
+	case DRM_FORMAT_RGB565 | DRM_FORMAT_BIG_ENDIAN:
+		if (!swap) {
+			for (y = 0; y < height; y++) {
+				memcpy(dst, src, width * 2);
+				src += fb->pitches[0];
+				dst += width * 2;
+			}
+			return 0;
+		}
+		op = TINYDRM_CONV_SWAB16;
+		break;
+	case DRM_FORMAT_XRGB8888:
+		op = swap ? TINYDRM_CONV_XRGB8888_TO_RGB565_SWAB :
+			    TINYDRM_CONV_XRGB8888_TO_RGB565;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	tinydrm_conv_lines(impl, op, dst, src, fb->pitches[0], cpp, width, height);
+
+	return 0;
+}
+
+/**
+ * tinydrm_fb_convert_rgb565 - Convert framebuffer clip to RGB565
+ * @dst: Destination buffer, the lines are packed
+ * @vaddr: Framebuffer virtual address
+ * @fb: Framebuffer
+ * @clip: Clip rectangle
+ * @swap: Swap the bytes of the result compared to the framebuffer byte order
+ *
+ * Supports RGB565 in both byte orders and XRGB8888. Each combination of
+ * format and swap has its own kernel, vectorized when the CPU supports it.
+ * Imported buffers must be bracketed with CPU access calls by the caller.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_fb_convert_rgb565(void *dst, void *vaddr, struct drm_framebuffer *fb,
+			      struct drm_rect *clip, bool swap)
+{
+	return tinydrm_fb_convert(dst, vaddr, fb, clip, swap, tinydrm_format_get());
+}
+EXPORT_SYMBOL(tinydrm_fb_convert_rgb565);
+
+/**
+ * tinydrm_fb_convert_diff_rgb565 - Convert framebuffer clip into a shadow buffer
+ * @shadow: RGB565 copy of what the display shows, the pitch is the fb width
+ * @vaddr: Framebuffer virtual address
+ * @fb: Framebuffer
+ * @clip: Clip rectangle
+ * @swap: Swap the bytes of the result compared to the framebuffer byte order
+ * @damage: Set to the part of @clip that changed, empty if nothing changed
+ * @buf: Scratch for %TINYDRM_DIFF_BAND_ROWS lines of the fb width in RGB565,
+ *       allocated once by the caller
+ *
+ * The clip is converted in bands of %TINYDRM_DIFF_BAND_ROWS lines and each line
+ * is compared with @shadow in tiles of %TINYDRM_TILE_SIZE pixels. Changed lines
+ * are copied to @shadow. @damage covers the changed tiles horizontally and
+ * the changed lines vertically.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_fb_convert_diff_rgb565(u16 *shadow, void *vaddr, struct drm_framebuffer *fb,
+				   struct drm_rect *clip, bool swap, struct drm_rect *damage,
+				   u16 *buf)
+{
+	const struct tinydrm_format_impl *impl = tinydrm_format_get();
+	unsigned int width = drm_rect_width(clip);
+	unsigned int x, n;
+	struct drm_rect band;
+	u16 *line, *sline;
+	bool changed;
+	int y, ret;
+	u32 mask;
+
+	damage->x1 = INT_MAX;
+	damage->y1 = INT_MAX;
+	damage->x2 = INT_MIN;
+	damage->y2 = INT_MIN;
+
+	band.x1 = clip->x1;
+	band.x2 = clip->x2;
+	for (band.y1 = clip->y1; band.y1 < clip->y2; band.y1 = band.y2) {
+		band.y2 = min(band.y1 + TINYDRM_DIFF_BAND_ROWS, clip->y2);
+
+		ret = tinydrm_fb_convert(buf, vaddr, fb, &band, swap, impl);
+		if (ret)
+			return ret;
+
+		if (impl->begin)
+			impl->begin();
+
+		for (y = band.y1; y < band.y2; y++) {
+			line = buf + (y - band.y1) * width;
+			sline = shadow + y * fb->width + clip->x1;
+			changed = false;
+
+			for (x = 0; x < width; x += n) {
+				n = min_t(unsigned int, width - x, TINYDRM_DIFF_MAX_PIXELS);
+				mask = impl->diff_tiles(line + x, sline + x, n);
+				if (!mask)
+					continue;
+
+				damage->x1 = min_t(int, damage->x1, clip->x1 + x +
+						   __ffs(mask) * TINYDRM_TILE_SIZE);
+				damage->x2 = max_t(int, damage->x2, clip->x1 + x +
+						   (__fls(mask) + 1) * TINYDRM_TILE_SIZE);
+				changed = true;
+			}
+
+			if (changed) {
+				memcpy(sline, line, width * sizeof(*line));
+				damage->y1 = min(damage->y1, y);
+				damage->y2 = max(damage->y2, y + 1);
+			}
+		}
+
+		if (impl->end)
+			impl->end();
+	}
+
+	if (damage->x1 == INT_MAX)
+		*damage = (struct drm_rect){ };
+	else
+		damage->x2 = min(damage->x2, clip->x2);
+
+	return 0;
+}
+EXPORT_SYMBOL(tinydrm_fb_convert_diff_rgb565);
+
+/**
+ * tinydrm_fb_rows_repeat - Check if a framebuffer clip is one line repeated
+ * @vaddr: Framebuffer virtual address
+ * @fb: Framebuffer
+ * @clip: Clip rectangle
+ * @line: Scratch for one line of @clip in the framebuffer format, allocated
+ *        once by the caller
+ *
+ * Compares the lines with the first one using the vectorized diff. The first
+ * line is copied to @line and the others go through the staging buffer a
+ * chunk at a time, which also bounds the SIMD sections. Imported buffers must
+ * be bracketed with CPU access calls by the caller.
+ *
+ * Returns:
+ * True if all the lines of @clip are the same.
+ */
+bool tinydrm_fb_rows_repeat(void *vaddr, struct drm_framebuffer *fb, struct drm_rect *clip,
+			    void *line)
+{
+	const struct tinydrm_format_impl *impl = tinydrm_format_get();
+	unsigned int cpp = fb->format->cpp[0];
+	/* Compared as 16-bit words */
+	unsigned int len = drm_rect_width(clip) * cpp / 2;
+	const u16 *first = line;
+	u16 *sbuf;
+	const void *src;
+	unsigned int x, n;
+	bool repeat = true;
+	int y;
+
+	src = vaddr + fb->offsets[0] + clip->y1 * fb->pitches[0] + clip->x1 * cpp;
+	memcpy(line, src, len * sizeof(u16));
+
+	for (y = clip->y1 + 1; y < clip->y2 && repeat; y++) {
+		const u16 *row = src + (y - clip->y1) * fb->pitches[0];
+
+		for (x = 0; x < len && repeat; x += n) {
+			n = min_t(unsigned int, len - x, TINYDRM_DIFF_MAX_PIXELS);
+			sbuf = get_cpu_ptr(tinydrm_conv_sbuf);
+			memcpy(sbuf, row + x, n * sizeof(u16));
+			repeat = !tinydrm_diff_run(impl, first + x, sbuf, n);
+			put_cpu_ptr(tinydrm_conv_sbuf);
+		}
+	}
+
+	return repeat;
+}
+EXPORT_SYMBOL(tinydrm_fb_rows_repeat);
+
+/* Odd length and offsets to exercise the tails */
+#define TINYDRM_SELFTEST_PIXELS	259
+
+/*
+ * Check the vectorized conversions against the DRM format helpers, and the
+ * tile diff, which has no DRM counterpart, against the scalar kernel.
+ */
+static bool tinydrm_format_selftest(const struct tinydrm_format_impl *impl)
+{
+	const struct tinydrm_format_impl *ref = &tinydrm_format_scalar;
+	unsigned int n = TINYDRM_SELFTEST_PIXELS;
+	struct drm_framebuffer fb = {
+		.width = n,
+		.height = 1,
+	};
+	u16 *expected, *result;
+	struct drm_rect clip;
+	enum tinydrm_conv_op op;
+	bool ok = false;
+	u32 *src, seed;
+	unsigned int i, offset;
+
+	src = kmalloc_array(n + 1, sizeof(*src), GFP_KERNEL);
+	expected = kmalloc_array(n + 1, sizeof(*expected), GFP_KERNEL);
+	result = kmalloc_array(n + 1, sizeof(*result), GFP_KERNEL);
+	if (!src || !expected || !result)
+		goto out_free;
+
+	for (i = 0, seed = 0x12345678; i < n + 1; i++) {
+		seed = seed * 1664525 + 1013904223;
+		src[i] = seed;
+	}
+
+	for (offset = 0; offset < 2; offset++) {
+		unsigned int len = n - offset;
+
+		drm_rect_init(&clip, offset, 0, len, 1);
+
+		for (op = TINYDRM_CONV_SWAB16; op <= TINYDRM_CONV_XRGB8888_TO_RGB565_SWAB; op++) {
+			const void *s = src + offset;
+
+			if (op == TINYDRM_CONV_SWAB16) {
+				s = (u16 *)src + offset;
+				fb.format = drm_format_info(DRM_FORMAT_RGB565);
+				fb.pitches[0] = n * sizeof(u16);
+				drm_fb_swab16(expected, src, &fb, &clip);
+			} else {
+				fb.format = drm_format_info(DRM_FORMAT_XRGB8888);
+				fb.pitches[0] = n * sizeof(u32);
+				drm_fb_xrgb8888_to_rgb565(expected, src, &fb, &clip,
+							  op == TINYDRM_CONV_XRGB8888_TO_RGB565_SWAB);
+			}
+
+			tinydrm_conv_run(impl, op, result + offset, s, len);
+			if (memcmp(expected, result + offset, len * 2))
+				goto out_free;
+		}
+
+		/* Changes in the first, a middle and the partial last tile */
+		memcpy(result, src, (n + 1) * sizeof(*result));
+		result[offset] ^= 0x0001;
+		result[offset + 100] ^= 0x8000;
+		result[offset + len - 1] ^= 0x0100;
+		if (tinydrm_diff_run(ref, (u16 *)src + offset, result + offset, len) !=
+		    tinydrm_diff_run(impl, (u16 *)src + offset, result + offset, len))
+			goto out_free;
+	}
+
+	ok = true;
+
+out_free:
+	kfree(result);
+	kfree(expected);
+	kfree(src);
+
+	return ok;
+}
+
+static int __init tinydrm_format_init(void)
+{
+	const struct tinydrm_format_impl *impl;
+	unsigned int i;
+
+	tinydrm_conv_sbuf = __alloc_percpu(TINYDRM_CONV_PIXELS * sizeof(u32), SMP_CACHE_BYTES);
+	if (!tinydrm_conv_sbuf)
+		return -ENOMEM;
+
+	if (!simd)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(tinydrm_format_impls); i++) {
+		impl = tinydrm_format_impls[i];
+
+		if (impl->supported && !impl->supported())
+			continue;
+
+		if (!tinydrm_format_selftest(impl)) {
+			pr_warn("tinydrm: %s conversion failed selftest\n", impl->name);
+			continue;
+		}
+
+		pr_debug("tinydrm: Using %s conversion\n", impl->name);
+		tinydrm_format_simd = impl;
+		break;
+	}
+
+	return 0;
+}
+module_init(tinydrm_format_init);
+
+static void __exit tinydrm_format_exit(void)
+{
+	free_percpu(tinydrm_conv_sbuf);
+}
+module_exit(tinydrm_format_exit);
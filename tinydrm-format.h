@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Pixel conversion kernels, internal to tinydrm-helpers
+ *
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#ifndef __TINYDRM_FORMAT_H__
+#define __TINYDRM_FORMAT_H__
+
+#include <linux/types.h>
+
+/**
+ * struct tinydrm_format_impl - Set of conversion kernels
+ * @name: Name
+ * @supported: Returns true if the CPU can run the kernels (optional)
+ * @begin: Called before using the kernels (optional)
+ * @end: Called after using the kernels (optional)
+ * @swab: Byte swap @n 16-bit pixels
+ * @xrgb8888_to_rgb565: Convert @n pixels
+ * @xrgb8888_to_rgb565_swab: Convert @n pixels and byte swap the result
+ * @diff_tiles: Compare @n pixels, at most %TINYDRM_DIFF_MAX_PIXELS, and return
+ *              a mask with bit N set if any of the pixels in tile N differ
+ *
+ * The kernels work on lines and can't fail. @src is cached memory, @dst
+ * can be unaligned.
+ */
+struct tinydrm_format_impl {
+	const char *name;
+	bool (*supported)(void);
+	void (*begin)(void);
+	void (*end)(void);
+	void (*swab)(u16 *dst, const u16 *src, unsigned int n);
+	void (*xrgb8888_to_rgb565)(u16 *dst, const u32 *src, unsigned int n);
+	void (*xrgb8888_to_rgb565_swab)(u16 *dst, const u32 *src, unsigned int n);
+	u32 (*diff_tiles)(const u16 *a, const u16 *b, unsigned int n);
+};
+
+/* Tiles are 16 pixels wide, the mask has room for 32 of them */
+#define TINYDRM_TILE_SIZE	16
+#define TINYDRM_DIFF_MAX_PIXELS	(32 * TINYDRM_TILE_SIZE)
+
+/* For the partial tile at the end */
+static inline bool tinydrm_pixels_differ(const u16 *a, const u16 *b, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		if (a[i] != b[i])
+			return true;
+
+	return false;
+}
+
+static inline u16 tinydrm_xrgb8888_to_rgb565_pixel(u32 pix)
+{
+	return ((pix & 0x00f80000) >> 8) |
+	       ((pix & 0x0000fc00) >> 5) |
+	       ((pix & 0x000000f8) >> 3);
+}
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+extern const struct tinydrm_format_impl tinydrm_format_neon;
+
+void tinydrm_swab16_neon_inner(u16 *dst, const u16 *src, unsigned int n);
+void tinydrm_xrgb8888_to_rgb565_neon_inner(u16 *dst, const u32 *src, unsigned int n);
+void tinydrm_xrgb8888_to_rgb565_swab_neon_inner(u16 *dst, const u32 *src, unsigned int n);
+u32 tinydrm_diff_tiles_neon_inner(const u16 *a, const u16 *b, unsigned int n);
+#endif
+
+#ifdef CONFIG_X86
+#ifdef TINYDRM_AS_AVX2
+extern const struct tinydrm_format_impl tinydrm_format_avx2;
+#endif
+extern const struct tinydrm_format_impl tinydrm_format_sse2;
+#endif
+
+#endif
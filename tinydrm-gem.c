@@ -0,0 +1,330 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Cached framebuffers for the tiny DRM drivers
+ *
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include <drm/drm_fb_cma_helper.h>
+#include <drm/drm_file.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_gem.h>
+#include <drm/drm_gem_cma_helper.h>
+#include <drm/drm_prime.h>
+#include <drm/drm_rect.h>
+
+#include "tinydrm-helpers.h"
+
+static bool cached_fb;
+module_param(cached_fb, bool, 0444);
+MODULE_PARM_DESC(cached_fb, "Allocate framebuffers in cached memory (default: false)");
+
+/*
+ * The CMA buffers are write-combined which makes reading them for conversion
+ * slow. A cached buffer is a CMA object backed by vmalloc memory instead, so
+ * the drivers can keep using drm_fb_cma_get_gem_obj() and ->vaddr. There's no
+ * ->paddr, the SPI core maps the buffer page by page when sending straight
+ * from it.
+ */
+
+static const struct drm_gem_object_funcs tinydrm_gem_cached_funcs;
+
+static bool tinydrm_gem_is_cached(struct drm_gem_object *obj)
+{
+	return obj->funcs == &tinydrm_gem_cached_funcs;
+}
+
+static void tinydrm_gem_cached_free(struct drm_gem_object *obj)
+{
+	struct drm_gem_cma_object *cma_obj = to_drm_gem_cma_obj(obj);
+
+	drm_gem_object_release(obj);
+	vfree(cma_obj->vaddr);
+	kfree(cma_obj);
+}
+
+static struct sg_table *tinydrm_gem_cached_get_sg_table(struct drm_gem_object *obj)
+{
+	struct drm_gem_cma_object *cma_obj = to_drm_gem_cma_obj(obj);
+	unsigned int i, npages = obj->size >> PAGE_SHIFT;
+	struct sg_table *sgt;
+	struct page **pages;
+
+	pages = kvmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < npages; i++)
+		pages[i] = vmalloc_to_page(cma_obj->vaddr + i * PAGE_SIZE);
+
+	sgt = drm_prime_pages_to_sg(pages, npages);
+	kvfree(pages);
+
+	return sgt;
+}
+
+static void *tinydrm_gem_cached_vmap(struct drm_gem_object *obj)
+{
+	return to_drm_gem_cma_obj(obj)->vaddr;
+}
+
+static const struct drm_gem_object_funcs tinydrm_gem_cached_funcs = {
+	.free = tinydrm_gem_cached_free,
+	.print_info = drm_gem_cma_print_info,
+	.get_sg_table = tinydrm_gem_cached_get_sg_table,
+	.vmap = tinydrm_gem_cached_vmap,
+	.vm_ops = &drm_gem_cma_vm_ops,
+};
+
+static struct drm_gem_cma_object *
+tinydrm_gem_cached_create(struct drm_device *drm, size_t size)
+{
+	struct drm_gem_cma_object *cma_obj;
+	struct drm_gem_object *obj;
+	int ret;
+
+	size = round_up(size, PAGE_SIZE);
+
+	cma_obj = kzalloc(sizeof(*cma_obj), GFP_KERNEL);
+	if (!cma_obj)
+		return ERR_PTR(-ENOMEM);
+
+	obj = &cma_obj->base;
+	obj->funcs = &tinydrm_gem_cached_funcs;
+	drm_gem_private_object_init(drm, obj, size);
+
+	ret = drm_gem_create_mmap_offset(obj);
+	if (ret)
+		goto err_release;
+
+	cma_obj->vaddr = vmalloc_user(size);
+	if (!cma_obj->vaddr) {
+		ret = -ENOMEM;
+		goto err_release;
+	}
+
+	return cma_obj;
+
+err_release:
+	drm_gem_object_release(obj);
+	kfree(cma_obj);
+
+	return ERR_PTR(ret);
+}
+
+/**
+ * tinydrm_gem_dumb_create - Create a dumb buffer
+ * @file: DRM file
+ * @drm: DRM device
+ * @args: Buffer parameters
+ *
+ * Creates a cached buffer if the cached_fb module parameter is set, otherwise
+ * a CMA buffer. This is used for both userspace and fbdev buffers.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_gem_dumb_create(struct drm_file *file, struct drm_device *drm,
+			    struct drm_mode_create_dumb *args)
+{
+	struct drm_gem_cma_object *cma_obj;
+	int ret;
+
+	if (!cached_fb)
+		return drm_gem_cma_dumb_create(file, drm, args);
+
+	args->pitch = DIV_ROUND_UP(args->width * args->bpp, 8);
+	args->size = args->pitch * args->height;
+
+	cma_obj = tinydrm_gem_cached_create(drm, args->size);
+	if (IS_ERR(cma_obj))
+		return PTR_ERR(cma_obj);
+
+	ret = drm_gem_handle_create(file, &cma_obj->base, &args->handle);
+	drm_gem_object_put_unlocked(&cma_obj->base);
+
+	return ret;
+}
+EXPORT_SYMBOL(tinydrm_gem_dumb_create);
+
+/**
+ * tinydrm_gem_mmap - Memory map a buffer
+ * @filp: File
+ * @vma: Virtual memory area
+ *
+ * Maps cached buffers cached and CMA buffers write-combined.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_gem_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct drm_gem_cma_object *cma_obj;
+	struct drm_gem_object *obj;
+	int ret;
+
+	ret = drm_gem_mmap(filp, vma);
+	if (ret)
+		return ret;
+
+	obj = vma->vm_private_data;
+	cma_obj = to_drm_gem_cma_obj(obj);
+
+	/* Undo the PFN map setup and fake offset from drm_gem_mmap() */
+	vma->vm_flags &= ~VM_PFNMAP;
+	vma->vm_pgoff = 0;
+
+	if (tinydrm_gem_is_cached(obj)) {
+		vma->vm_flags &= ~VM_IO;
+		vma->vm_page_prot = vm_get_page_prot(vma->vm_flags);
+		ret = remap_vmalloc_range(vma, cma_obj->vaddr, 0);
+	} else {
+		ret = dma_mmap_wc(obj->dev->dev, vma, cma_obj->vaddr,
+				  cma_obj->paddr, vma->vm_end - vma->vm_start);
+	}
+	if (ret)
+		drm_gem_vm_close(vma);
+
+	return ret;
+}
+EXPORT_SYMBOL(tinydrm_gem_mmap);
+
+/* The damaged lines of a cached buffer */
+static void *tinydrm_fb_clip_lines(struct drm_framebuffer *fb, struct drm_rect *clip,
+				   size_t *len)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+
+	*len = drm_rect_height(clip) * fb->pitches[0];
+
+	return cma_obj->vaddr + fb->offsets[0] + clip->y1 * fb->pitches[0];
+}
+
+/* The bytes spanned by a clip in the framebuffer, the lines in between included */
+static void tinydrm_fb_clip_span(struct drm_framebuffer *fb, struct drm_rect *clip,
+				 unsigned int *offset, unsigned int *len)
+{
+	unsigned int cpp = fb->format->cpp[0];
+	unsigned int start, end;
+
+	start = fb->offsets[0] + clip->y1 * fb->pitches[0] + clip->x1 * cpp;
+	end = fb->offsets[0] + (clip->y2 - 1) * fb->pitches[0] + clip->x2 * cpp;
+
+	*offset = start;
+	*len = end - start;
+}
+
+static int tinydrm_fb_dma_buf_access(struct drm_framebuffer *fb, struct drm_rect *clip,
+				     struct dma_buf *dmabuf, bool begin)
+{
+#ifdef HAVE_DMA_BUF_PARTIAL
+	unsigned int offset, len;
+
+	/* Not all exporters can do partial access */
+	if (begin && dmabuf->ops->begin_cpu_access_partial) {
+		tinydrm_fb_clip_span(fb, clip, &offset, &len);
+		return dma_buf_begin_cpu_access_partial(dmabuf, DMA_FROM_DEVICE,
+							offset, len);
+	}
+
+	if (!begin && dmabuf->ops->end_cpu_access_partial) {
+		tinydrm_fb_clip_span(fb, clip, &offset, &len);
+		return dma_buf_end_cpu_access_partial(dmabuf, DMA_FROM_DEVICE,
+						      offset, len);
+	}
+#endif
+	if (begin)
+		return dma_buf_begin_cpu_access(dmabuf, DMA_FROM_DEVICE);
+
+	return dma_buf_end_cpu_access(dmabuf, DMA_FROM_DEVICE);
+}
+
+/**
+ * tinydrm_fb_begin_cpu_access - Prepare for reading a framebuffer clip
+ * @fb: Framebuffer
+ * @clip: Clip rectangle that is going to be read
+ *
+ * Imported buffers are synced for CPU access, only the bytes spanned by @clip
+ * if the kernel and exporter support partial access. For cached buffers the
+ * kernel mapping of the damaged lines is invalidated so it doesn't hold stale
+ * lines on CPUs with aliasing caches; this is a no-op elsewhere. Nothing is
+ * done for an empty clip.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_fb_begin_cpu_access(struct drm_framebuffer *fb, struct drm_rect *clip)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	struct dma_buf_attachment *import_attach = cma_obj->base.import_attach;
+	size_t len;
+	void *vaddr;
+
+	if (!drm_rect_visible(clip))
+		return 0;
+
+	if (import_attach)
+		return tinydrm_fb_dma_buf_access(fb, clip, import_attach->dmabuf, true);
+
+	if (tinydrm_gem_is_cached(&cma_obj->base)) {
+		vaddr = tinydrm_fb_clip_lines(fb, clip, &len);
+		invalidate_kernel_vmap_range(vaddr, len);
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL(tinydrm_fb_begin_cpu_access);
+
+/**
+ * tinydrm_fb_end_cpu_access - Done reading a framebuffer clip
+ * @fb: Framebuffer
+ * @clip: Clip rectangle that was read, same as for the begin call
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_fb_end_cpu_access(struct drm_framebuffer *fb, struct drm_rect *clip)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	struct dma_buf_attachment *import_attach = cma_obj->base.import_attach;
+
+	if (!drm_rect_visible(clip))
+		return 0;
+
+	if (import_attach)
+		return tinydrm_fb_dma_buf_access(fb, clip, import_attach->dmabuf, false);
+
+	return 0;
+}
+EXPORT_SYMBOL(tinydrm_fb_end_cpu_access);
+
+/**
+ * tinydrm_fb_sync_for_device - Prepare for sending a clip straight from a framebuffer
+ * @fb: Framebuffer
+ * @clip: Clip rectangle that is going to be sent
+ *
+ * Writes back the damaged lines of a cached buffer from the kernel mapping on
+ * CPUs with aliasing caches. The SPI core does the DMA cache maintenance for
+ * the lines that are actually sent.
+ */
+void tinydrm_fb_sync_for_device(struct drm_framebuffer *fb, struct drm_rect *clip)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	size_t len;
+	void *vaddr;
+
+	if (!tinydrm_gem_is_cached(&cma_obj->base))
+		return;
+
+	vaddr = tinydrm_fb_clip_lines(fb, clip, &len);
+	flush_kernel_vmap_range(vaddr, len);
+}
+EXPORT_SYMBOL(tinydrm_fb_sync_for_device);
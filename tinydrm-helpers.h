@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Helpers shared by the tiny DRM drivers
+ *
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#ifndef __TINYDRM_HELPERS_H__
+#define __TINYDRM_HELPERS_H__
+
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#include <drm/drm_mipi_dbi.h>
+#include <drm/drm_rect.h>
+
+struct dentry;
+struct device;
+struct drm_crtc;
+struct drm_crtc_state;
+struct drm_device;
+struct drm_display_mode;
+struct drm_file;
+struct drm_framebuffer;
+struct drm_minor;
+struct drm_mode_create_dumb;
+struct drm_pending_vblank_event;
+struct drm_plane_state;
+struct drm_simple_display_pipe;
+struct file;
+struct gpio_desc;
+struct vm_area_struct;
+
+/*
+ * Init sequences
+ *
+ * A sequence is a list of commands, each made up of the command (or register)
+ * number, a length byte and the parameter bytes. The command number is 1 or 2
+ * bytes, MSB first. Command 0 with a single parameter byte is a delay in
+ * milliseconds.
+ *
+ * A firmware file holds a struct tinydrm_seq_header followed by the commands.
+ */
+
+#define TINYDRM_SEQ_MAGIC	"TDRM-SEQ"
+#define TINYDRM_SEQ_VERSION	1
+
+struct tinydrm_seq_header {
+	u8 magic[8];
+	u8 version;
+	u8 cmd_size;
+	u8 reserved[6];
+} __packed;
+
+/* Built-in tables with 1 byte commands */
+#define TINYDRM_SEQ_CMD(cmd, ...) \
+	(cmd), sizeof((u8[]){ __VA_ARGS__ }), ##__VA_ARGS__
+#define TINYDRM_SEQ_DELAY(ms)	0x00, 1, (ms)
+
+/**
+ * struct tinydrm_seq_cmd - Init sequence command
+ * @cmd: Command or register number
+ * @len: Number of parameter bytes
+ * @params: Parameters
+ */
+struct tinydrm_seq_cmd {
+	u16 cmd;
+	u8 len;
+	const u8 *params;
+};
+
+/**
+ * struct tinydrm_seq - Parsed init sequence
+ * @cmds: Commands
+ * @num_cmds: Number of commands
+ */
+struct tinydrm_seq {
+	struct tinydrm_seq_cmd *cmds;
+	unsigned int num_cmds;
+};
+
+static inline bool tinydrm_seq_cmd_is_delay(const struct tinydrm_seq_cmd *cmd)
+{
+	return !cmd->cmd && cmd->len == 1;
+}
+
+int devm_tinydrm_seq_load(struct device *dev, struct tinydrm_seq *seq,
+			  unsigned int cmd_size, const u8 *builtin, size_t len);
+int tinydrm_seq_run_mipi_dbi(struct mipi_dbi *dbi, const struct tinydrm_seq *seq);
+
+int tinydrm_fb_convert_rgb565(void *dst, void *vaddr, struct drm_framebuffer *fb,
+			      struct drm_rect *clip, bool swap);
+
+/* Rows per band in tinydrm_fb_convert_diff_rgb565(), its @buf holds one band */
+#define TINYDRM_DIFF_BAND_ROWS	16
+
+int tinydrm_fb_convert_diff_rgb565(u16 *shadow, void *vaddr, struct drm_framebuffer *fb,
+				   struct drm_rect *clip, bool swap, struct drm_rect *damage,
+				   u16 *buf);
+bool tinydrm_fb_rows_repeat(void *vaddr, struct drm_framebuffer *fb, struct drm_rect *clip,
+			    void *line);
+
+#define TINYDRM_FLUSH_MAX_CLIPS	8
+
+struct tinydrm_flush;
+
+typedef void (*tinydrm_flush_func)(struct tinydrm_flush *flush, struct drm_framebuffer *fb,
+				   struct drm_rect *clips, unsigned int num_clips);
+
+/**
+ * struct tinydrm_flush - Flush worker
+ * @func: Sends the damage clips, called from the worker
+ * @present: Optional, returns when a frame sent at the given time shows up
+ * @work: Worker
+ * @timer: Starts the worker when the frame rate cap holds back a flush
+ * @crtc: CRTC
+ * @vblank: Vblank is emulated
+ * @vblank_timer: Emulated vblank
+ * @latch_event: Event for the frame being flushed, only used by the worker
+ * @flush_ns: Average flush time
+ * @lock: Protects the pending frame, the frame rate cap and the counters
+ * @fps: Frame rate cap, zero means no limit
+ * @last: When the last flush started
+ * @running: Between tinydrm_flush_start() and tinydrm_flush_stop()
+ * @fb: Pending framebuffer, holds a reference
+ * @event: Pending page flip event
+ * @clips: Pending damage, merged into one when it runs out of slots
+ * @num_clips: Number of pending damage clips
+ * @queued: Number of frames queued
+ * @flushed: Number of frames flushed
+ * @dropped: Number of pending frames replaced before they were flushed
+ */
+struct tinydrm_flush {
+	tinydrm_flush_func func;
+	ktime_t (*present)(struct tinydrm_flush *flush, ktime_t time);
+	struct work_struct work;
+	struct hrtimer timer;
+	struct drm_crtc *crtc;
+	bool vblank;
+	struct hrtimer vblank_timer;
+	struct drm_pending_vblank_event *latch_event;
+	u64 flush_ns;
+	spinlock_t lock;
+	unsigned int fps;
+	ktime_t last;
+	bool running;
+	struct drm_framebuffer *fb;
+	struct drm_pending_vblank_event *event;
+	struct drm_rect clips[TINYDRM_FLUSH_MAX_CLIPS];
+	unsigned int num_clips;
+	u64 queued;
+	u64 flushed;
+	u64 dropped;
+};
+
+void tinydrm_flush_init(struct tinydrm_flush *flush, struct drm_crtc *crtc,
+			tinydrm_flush_func func);
+void tinydrm_flush_latch(struct tinydrm_flush *flush, u64 remaining_ns);
+void tinydrm_flush_set_fps(struct tinydrm_flush *flush, unsigned int fps);
+void tinydrm_flush_queue(struct tinydrm_flush *flush, struct drm_plane_state *old_state,
+			 struct drm_plane_state *state);
+void tinydrm_flush_start(struct tinydrm_flush *flush, struct drm_framebuffer *fb);
+void tinydrm_flush_stop(struct tinydrm_flush *flush);
+void tinydrm_flush_debugfs_init(struct tinydrm_flush *flush, struct dentry *root);
+int tinydrm_flush_vblank_init(struct tinydrm_flush *flush);
+int tinydrm_flush_enable_vblank(struct tinydrm_flush *flush);
+void tinydrm_flush_disable_vblank(struct tinydrm_flush *flush);
+void tinydrm_mode_set_bus_clock(struct drm_display_mode *mode, u32 bus_hz,
+				unsigned int bits_per_pixel);
+
+/**
+ * struct tinydrm_mipi_dbi - MIPI DBI device with a flush worker
+ * @dbidev: MIPI DBI device, must be first since it's freed by mipi_dbi_release()
+ * @flush: Flush worker
+ * @te: Optional tearing effect gpio
+ * @te_done: Completed on each TE pulse
+ * @te_lock: Protects @te_last and @te_period
+ * @te_last: Time of the last TE pulse
+ * @te_period: Time between TE pulses, zero until known
+ */
+struct tinydrm_mipi_dbi {
+	struct mipi_dbi_dev dbidev;
+	struct tinydrm_flush flush;
+	struct gpio_desc *te;
+	int te_irq;
+	/* Cleared if the TE pulse goes missing, vblank falls back to the timer */
+	bool te_sync;
+	struct completion te_done;
+	spinlock_t te_lock;
+	ktime_t te_last;
+	ktime_t te_period;
+};
+
+static inline struct tinydrm_mipi_dbi *drm_to_tinydrm_mipi_dbi(struct drm_device *drm)
+{
+	return container_of(drm_to_mipi_dbi_dev(drm), struct tinydrm_mipi_dbi, dbidev);
+}
+
+int tinydrm_mipi_dbi_dev_init(struct tinydrm_mipi_dbi *tdbi,
+			      const struct drm_simple_display_pipe_funcs *funcs,
+			      const struct drm_display_mode *mode, unsigned int rotation);
+void tinydrm_mipi_dbi_pipe_update(struct drm_simple_display_pipe *pipe,
+				  struct drm_plane_state *old_state);
+void tinydrm_mipi_dbi_enable_flush(struct mipi_dbi_dev *dbidev,
+				   struct drm_crtc_state *crtc_state,
+				   struct drm_plane_state *plane_state);
+void tinydrm_mipi_dbi_pipe_disable(struct drm_simple_display_pipe *pipe);
+int tinydrm_mipi_dbi_enable_vblank(struct drm_simple_display_pipe *pipe);
+void tinydrm_mipi_dbi_disable_vblank(struct drm_simple_display_pipe *pipe);
+int tinydrm_mipi_dbi_debugfs_init(struct drm_minor *minor);
+
+int tinydrm_gem_dumb_create(struct drm_file *file, struct drm_device *drm,
+			    struct drm_mode_create_dumb *args);
+int tinydrm_gem_mmap(struct file *filp, struct vm_area_struct *vma);
+int tinydrm_fb_begin_cpu_access(struct drm_framebuffer *fb, struct drm_rect *clip);
+int tinydrm_fb_end_cpu_access(struct drm_framebuffer *fb, struct drm_rect *clip);
+void tinydrm_fb_sync_for_device(struct drm_framebuffer *fb, struct drm_rect *clip);
+
+/* CMA buffers, or cached buffers when the cached_fb module parameter is set */
+#define DEFINE_TINYDRM_GEM_FOPS(name) \
+	static const struct file_operations name = {\
+		.owner		= THIS_MODULE,\
+		.open		= drm_open,\
+		.release	= drm_release,\
+		.unlocked_ioctl	= drm_ioctl,\
+		.compat_ioctl	= drm_compat_ioctl,\
+		.poll		= drm_poll,\
+		.read		= drm_read,\
+		.llseek		= noop_llseek,\
+		.mmap		= tinydrm_gem_mmap,\
+	}
+
+#define TINYDRM_GEM_DRIVER_OPS \
+	.gem_create_object	= drm_cma_gem_create_object_default_funcs, \
+	.dumb_create		= tinydrm_gem_dumb_create, \
+	.prime_handle_to_fd	= drm_gem_prime_handle_to_fd, \
+	.prime_fd_to_handle	= drm_gem_prime_fd_to_handle, \
+	.gem_prime_import_sg_table = drm_gem_cma_prime_import_sg_table_vmap, \
+	.gem_prime_mmap		= drm_gem_prime_mmap
+
+#endif
@@ -0,0 +1,393 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * MIPI DBI flushing for the tiny DRM drivers
+ *
+ * Copyright 2020 Noralf Trønnes
+ *
+ * Same as the mipi_dbi helpers but with the faster pixel conversion.
+ */
+
+#include <linux/backlight.h>
+#include <linux/gpio/consumer.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/module.h>
+#include <linux/property.h>
+
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_fb_cma_helper.h>
+#include <drm/drm_file.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_gem_cma_helper.h>
+#include <drm/drm_mipi_dbi.h>
+#include <drm/drm_print.h>
+#include <drm/drm_rect.h>
+#include <drm/drm_vblank.h>
+
+#include <video/mipi_display.h>
+
+#include "tinydrm-helpers.h"
+
+/* A few panel refresh cycles */
+#define TINYDRM_MIPI_DBI_TE_TIMEOUT_MS	100
+
+/*
+ * The TE (tearing effect) line pulses when the panel starts a new refresh
+ * cycle. Writing to memory from that point on keeps the write behind the
+ * scan instead of crossing it somewhere random on the screen.
+ */
+static irqreturn_t tinydrm_mipi_dbi_te_handler(int irq, void *data)
+{
+	struct tinydrm_mipi_dbi *tdbi = data;
+	ktime_t now = ktime_get();
+	ktime_t period;
+
+	spin_lock(&tdbi->te_lock);
+	period = ktime_sub(now, tdbi->te_last);
+	/* Skip the gap after the panel has been off */
+	if (tdbi->te_last && period < ms_to_ktime(TINYDRM_MIPI_DBI_TE_TIMEOUT_MS))
+		tdbi->te_period = period;
+	tdbi->te_last = now;
+	spin_unlock(&tdbi->te_lock);
+
+	complete_all(&tdbi->te_done);
+	drm_crtc_handle_vblank(&tdbi->dbidev.pipe.crtc);
+
+	return IRQ_HANDLED;
+}
+
+/* The first TE pulse at or after @time, predicted from the last pulses */
+static ktime_t tinydrm_mipi_dbi_te_after(struct tinydrm_mipi_dbi *tdbi, ktime_t time)
+{
+	ktime_t last, period;
+	unsigned long flags;
+	s64 delta;
+
+	if (!READ_ONCE(tdbi->te_sync))
+		return time;
+
+	spin_lock_irqsave(&tdbi->te_lock, flags);
+	last = tdbi->te_last;
+	period = tdbi->te_period;
+	spin_unlock_irqrestore(&tdbi->te_lock, flags);
+
+	if (!period)
+		return time;
+
+	delta = ktime_to_ns(ktime_sub(time, last));
+	if (delta <= 0)
+		return last;
+
+	return ktime_add_ns(last, div64_u64(delta + period - 1, period) * period);
+}
+
+static ktime_t tinydrm_mipi_dbi_present(struct tinydrm_flush *flush, ktime_t time)
+{
+	return tinydrm_mipi_dbi_te_after(container_of(flush, struct tinydrm_mipi_dbi, flush),
+					 time);
+}
+
+/*
+ * If the pulse doesn't show up the TE line is most likely not connected or the
+ * panel doesn't drive it. Stop waiting for it from then on and let the timer
+ * take over vblank. The timer stops by itself if vblank is off.
+ */
+static void tinydrm_mipi_dbi_wait_te(struct tinydrm_mipi_dbi *tdbi)
+{
+	unsigned long timeout = msecs_to_jiffies(TINYDRM_MIPI_DBI_TE_TIMEOUT_MS);
+
+	if (!tdbi->te_sync)
+		return;
+
+	reinit_completion(&tdbi->te_done);
+	if (wait_for_completion_timeout(&tdbi->te_done, timeout))
+		return;
+
+	dev_warn(tdbi->dbidev.drm.dev, "No TE pulse within %u ms, disabling TE sync\n",
+		 TINYDRM_MIPI_DBI_TE_TIMEOUT_MS);
+	WRITE_ONCE(tdbi->te_sync, false);
+	disable_irq(tdbi->te_irq);
+	tinydrm_flush_enable_vblank(&tdbi->flush);
+}
+
+static int tinydrm_mipi_dbi_buf_copy(void *dst, struct drm_framebuffer *fb,
+				     struct drm_rect *clip, bool swap)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	int ret;
+
+	ret = tinydrm_fb_begin_cpu_access(fb, clip);
+	if (ret)
+		return ret;
+
+	ret = tinydrm_fb_convert_rgb565(dst, cma_obj->vaddr, fb, clip, swap);
+
+	tinydrm_fb_end_cpu_access(fb, clip);
+
+	return ret;
+}
+
+static void tinydrm_mipi_dbi_fb_dirty(struct drm_framebuffer *fb, struct drm_rect *rect)
+{
+	struct drm_gem_cma_object *cma_obj = drm_fb_cma_get_gem_obj(fb, 0);
+	struct tinydrm_mipi_dbi *tdbi = drm_to_tinydrm_mipi_dbi(fb->dev);
+	struct mipi_dbi_dev *dbidev = &tdbi->dbidev;
+	unsigned int height = rect->y2 - rect->y1;
+	unsigned int width = rect->x2 - rect->x1;
+	struct mipi_dbi *dbi = &dbidev->dbi;
+	size_t len = width * height * 2;
+	bool swap = dbi->swap_bytes;
+	int idx, ret = 0;
+	ktime_t now, start;
+	bool full;
+	u64 ns;
+	void *tr;
+
+	if (!dbidev->enabled)
+		return;
+
+	if (!drm_dev_enter(fb->dev, &idx))
+		return;
+
+	full = width == fb->width && height == fb->height;
+
+	DRM_DEBUG_KMS("Flushing [FB:%d] " DRM_RECT_FMT "\n", fb->base.id, DRM_RECT_ARG(rect));
+
+	if (!dbi->dc || !full || swap ||
+	    fb->format->format == DRM_FORMAT_XRGB8888) {
+		tr = dbidev->tx_buf;
+		ret = tinydrm_mipi_dbi_buf_copy(dbidev->tx_buf, fb, rect, swap);
+		if (ret)
+			goto err_msg;
+
+		/* The write waits for TE, then 9 bits per byte without D/C */
+		now = ktime_get();
+		start = tinydrm_mipi_dbi_te_after(tdbi, now);
+		ns = div_u64((u64)len * (dbi->dc ? 8 : 9) * NSEC_PER_SEC, dbi->spi->max_speed_hz);
+		tinydrm_flush_latch(&tdbi->flush, ktime_to_ns(ktime_sub(start, now)) + ns);
+	} else {
+		tr = cma_obj->vaddr;
+		tinydrm_fb_sync_for_device(fb, rect);
+	}
+
+	mipi_dbi_command(dbi, MIPI_DCS_SET_COLUMN_ADDRESS,
+			 (rect->x1 >> 8) & 0xff, rect->x1 & 0xff,
+			 ((rect->x2 - 1) >> 8) & 0xff, (rect->x2 - 1) & 0xff);
+	mipi_dbi_command(dbi, MIPI_DCS_SET_PAGE_ADDRESS,
+			 (rect->y1 >> 8) & 0xff, rect->y1 & 0xff,
+			 ((rect->y2 - 1) >> 8) & 0xff, (rect->y2 - 1) & 0xff);
+
+	tinydrm_mipi_dbi_wait_te(tdbi);
+	ret = mipi_dbi_command_buf(dbi, MIPI_DCS_WRITE_MEMORY_START, tr, len);
+err_msg:
+	if (ret)
+		dev_err_once(fb->dev->dev, "Failed to update display %d\n", ret);
+
+	drm_dev_exit(idx);
+}
+
+static void tinydrm_mipi_dbi_flush(struct tinydrm_flush *flush, struct drm_framebuffer *fb,
+				   struct drm_rect *clips, unsigned int num_clips)
+{
+	struct drm_rect rect = clips[0];
+	unsigned int i;
+
+	for (i = 1; i < num_clips; i++) {
+		rect.x1 = min(rect.x1, clips[i].x1);
+		rect.y1 = min(rect.y1, clips[i].y1);
+		rect.x2 = max(rect.x2, clips[i].x2);
+		rect.y2 = max(rect.y2, clips[i].y2);
+	}
+
+	tinydrm_mipi_dbi_fb_dirty(fb, &rect);
+}
+
+/**
+ * tinydrm_mipi_dbi_dev_init - MIPI DBI device initialization
+ * @tdbi: Device structure
+ * @funcs: Display pipe functions
+ * @mode: Display mode
+ * @rotation: Initial rotation in degrees Counter Clock Wise
+ *
+ * Same as mipi_dbi_dev_init() and sets up the flush worker. The mode clock is
+ * set from the SPI clock, see tinydrm_mode_set_bus_clock(). The frame rate
+ * cap is taken from the 'fps' device property. If there's a 'te' gpio, memory
+ * writes start on the TE pulse and the pulse drives vblank, otherwise vblank
+ * is emulated by the flush worker. The panel init sequence has to turn on the
+ * TE output. The TE interrupt is only enabled while the display is on, and if
+ * the pulse doesn't arrive within %TINYDRM_MIPI_DBI_TE_TIMEOUT_MS of a flush,
+ * TE sync is turned off for good.
+ */
+int tinydrm_mipi_dbi_dev_init(struct tinydrm_mipi_dbi *tdbi,
+			      const struct drm_simple_display_pipe_funcs *funcs,
+			      const struct drm_display_mode *mode, unsigned int rotation)
+{
+	struct drm_device *drm = &tdbi->dbidev.drm;
+	struct device *dev = drm->dev;
+	int ret, irq;
+	u32 fps;
+
+	tinydrm_flush_init(&tdbi->flush, &tdbi->dbidev.pipe.crtc, tinydrm_mipi_dbi_flush);
+	if (!device_property_read_u32(dev, "fps", &fps))
+		tinydrm_flush_set_fps(&tdbi->flush, fps);
+
+	init_completion(&tdbi->te_done);
+	spin_lock_init(&tdbi->te_lock);
+	tdbi->te = devm_gpiod_get_optional(dev, "te", GPIOD_IN);
+	if (IS_ERR(tdbi->te)) {
+		DRM_DEV_ERROR(dev, "Failed to get gpio 'te'\n");
+		return PTR_ERR(tdbi->te);
+	}
+
+	ret = mipi_dbi_dev_init(&tdbi->dbidev, funcs, mode, rotation);
+	if (ret)
+		return ret;
+
+	/* 9-bit words without a D/C line */
+	tinydrm_mode_set_bus_clock(&tdbi->dbidev.mode, tdbi->dbidev.dbi.spi->max_speed_hz,
+				   tdbi->dbidev.dbi.dc ? 16 : 18);
+
+	if (!tdbi->te)
+		return tinydrm_flush_vblank_init(&tdbi->flush);
+
+	ret = drm_vblank_init(drm, 1);
+	if (ret)
+		return ret;
+
+	tdbi->flush.present = tinydrm_mipi_dbi_present;
+
+	irq = gpiod_to_irq(tdbi->te);
+	if (irq < 0)
+		return irq;
+
+	/* Enabled with the display */
+	irq_set_status_flags(irq, IRQ_NOAUTOEN);
+	ret = devm_request_irq(dev, irq, tinydrm_mipi_dbi_te_handler,
+			       IRQF_TRIGGER_RISING, "te", tdbi);
+	if (ret)
+		return ret;
+
+	tdbi->te_irq = irq;
+	tdbi->te_sync = true;
+
+	return 0;
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_dev_init);
+
+/**
+ * tinydrm_mipi_dbi_pipe_update - Display pipe update helper
+ * @pipe: Simple display pipe
+ * @old_state: Old plane state
+ *
+ * Replacement for mipi_dbi_pipe_update() that hands the damage to the flush
+ * worker instead of flushing in the commit.
+ */
+void tinydrm_mipi_dbi_pipe_update(struct drm_simple_display_pipe *pipe,
+				  struct drm_plane_state *old_state)
+{
+	struct tinydrm_mipi_dbi *tdbi = drm_to_tinydrm_mipi_dbi(pipe->crtc.dev);
+	struct drm_plane_state *state = pipe->plane.state;
+
+	tinydrm_flush_queue(&tdbi->flush, old_state, state);
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_pipe_update);
+
+/**
+ * tinydrm_mipi_dbi_enable_flush - Flush the framebuffer and turn on backlight
+ * @dbidev: MIPI DBI device structure
+ * @crtc_state: CRTC state
+ * @plane_state: Plane state
+ *
+ * Drop-in replacement for mipi_dbi_enable_flush().
+ */
+void tinydrm_mipi_dbi_enable_flush(struct mipi_dbi_dev *dbidev,
+				   struct drm_crtc_state *crtc_state,
+				   struct drm_plane_state *plane_state)
+{
+	struct tinydrm_mipi_dbi *tdbi = container_of(dbidev, struct tinydrm_mipi_dbi, dbidev);
+	int idx;
+
+	if (!drm_dev_enter(&dbidev->drm, &idx))
+		return;
+
+	dbidev->enabled = true;
+	if (tdbi->te_sync)
+		enable_irq(tdbi->te_irq);
+	tinydrm_flush_start(&tdbi->flush, plane_state->fb);
+	backlight_enable(dbidev->backlight);
+	drm_crtc_vblank_on(crtc_state->crtc);
+
+	drm_dev_exit(idx);
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_enable_flush);
+
+/**
+ * tinydrm_mipi_dbi_pipe_disable - Display pipe disable helper
+ * @pipe: Simple display pipe
+ *
+ * Same as mipi_dbi_pipe_disable() and stops the flush worker and the TE
+ * interrupt first.
+ */
+void tinydrm_mipi_dbi_pipe_disable(struct drm_simple_display_pipe *pipe)
+{
+	struct tinydrm_mipi_dbi *tdbi = drm_to_tinydrm_mipi_dbi(pipe->crtc.dev);
+
+	drm_crtc_vblank_off(&pipe->crtc);
+	tinydrm_flush_stop(&tdbi->flush);
+	/* The worker has stopped, so TE sync can't be turned off under us */
+	if (tdbi->te_sync)
+		disable_irq(tdbi->te_irq);
+	mipi_dbi_pipe_disable(pipe);
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_pipe_disable);
+
+/**
+ * tinydrm_mipi_dbi_enable_vblank - Display pipe enable vblank helper
+ * @pipe: Simple display pipe
+ *
+ * Starts the emulated vblank, the TE interrupt is on with the display.
+ */
+int tinydrm_mipi_dbi_enable_vblank(struct drm_simple_display_pipe *pipe)
+{
+	struct tinydrm_mipi_dbi *tdbi = drm_to_tinydrm_mipi_dbi(pipe->crtc.dev);
+
+	if (READ_ONCE(tdbi->te_sync))
+		return 0;
+
+	return tinydrm_flush_enable_vblank(&tdbi->flush);
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_enable_vblank);
+
+/**
+ * tinydrm_mipi_dbi_disable_vblank - Display pipe disable vblank helper
+ * @pipe: Simple display pipe
+ */
+void tinydrm_mipi_dbi_disable_vblank(struct drm_simple_display_pipe *pipe)
+{
+	struct tinydrm_mipi_dbi *tdbi = drm_to_tinydrm_mipi_dbi(pipe->crtc.dev);
+
+	if (!READ_ONCE(tdbi->te_sync))
+		tinydrm_flush_disable_vblank(&tdbi->flush);
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_disable_vblank);
+
+/**
+ * tinydrm_mipi_dbi_debugfs_init - Create debugfs entries
+ * @minor: DRM minor
+ *
+ * Same as mipi_dbi_debugfs_init() and adds the flush counters.
+ */
+int tinydrm_mipi_dbi_debugfs_init(struct drm_minor *minor)
+{
+	struct tinydrm_mipi_dbi *tdbi = drm_to_tinydrm_mipi_dbi(minor->dev);
+
+	tinydrm_flush_debugfs_init(&tdbi->flush, minor->debugfs_root);
+#ifdef CONFIG_DEBUG_FS
+	return mipi_dbi_debugfs_init(minor);
+#else
+	return 0;
+#endif
+}
+EXPORT_SYMBOL(tinydrm_mipi_dbi_debugfs_init);
@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Init sequences for the tiny DRM drivers
+ *
+ * Copyright 2020 Noralf Trønnes
+ */
+
+#include <linux/delay.h>
+#include <linux/device.h>
+#include <linux/firmware.h>
+#include <linux/module.h>
+#include <linux/property.h>
+#include <linux/slab.h>
+
+#include <drm/drm_mipi_dbi.h>
+
+#include "tinydrm-helpers.h"
+
+static int tinydrm_seq_parse(struct device *dev, struct tinydrm_seq *seq,
+			     unsigned int cmd_size, const u8 *data, size_t size)
+{
+	unsigned int i, num_cmds = 0;
+	size_t pos = 0;
+	u8 len;
+
+	if (cmd_size != 1 && cmd_size != 2)
+		return -EINVAL;
+
+	/* Validate and count the commands before storing them */
+	while (pos < size) {
+		if (pos + cmd_size + 1 > size)
+			goto err_truncated;
+		len = data[pos + cmd_size];
+		pos += cmd_size + 1 + len;
+		if (pos > size)
+			goto err_truncated;
+		num_cmds++;
+	}
+
+	if (!num_cmds) {
+		dev_err(dev, "Init sequence is empty\n");
+		return -EINVAL;
+	}
+
+	seq->cmds = devm_kcalloc(dev, num_cmds, sizeof(*seq->cmds), GFP_KERNEL);
+	if (!seq->cmds)
+		return -ENOMEM;
+
+	for (i = 0, pos = 0; i < num_cmds; i++) {
+		struct tinydrm_seq_cmd *cmd = &seq->cmds[i];
+
+		cmd->cmd = cmd_size == 2 ? (data[pos] << 8) | data[pos + 1] : data[pos];
+		cmd->len = data[pos + cmd_size];
+		cmd->params = &data[pos + cmd_size + 1];
+		pos += cmd_size + 1 + cmd->len;
+	}
+
+	seq->num_cmds = num_cmds;
+
+	return 0;
+
+err_truncated:
+	dev_err(dev, "Init sequence is truncated at offset %zu\n", pos);
+
+	return -EINVAL;
+}
+
+static int devm_tinydrm_seq_request(struct device *dev, struct tinydrm_seq *seq,
+				    unsigned int cmd_size, const char *name)
+{
+	const struct tinydrm_seq_header *hdr;
+	const struct firmware *fw;
+	const u8 *data;
+	size_t size;
+	int ret;
+
+	ret = request_firmware(&fw, name, dev);
+	if (ret) {
+		dev_err(dev, "Failed to load init sequence '%s' %d\n", name, ret);
+		return ret;
+	}
+
+	hdr = (const struct tinydrm_seq_header *)fw->data;
+	if (fw->size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, TINYDRM_SEQ_MAGIC, sizeof(hdr->magic))) {
+		dev_err(dev, "%s: Not an init sequence\n", name);
+		ret = -EINVAL;
+		goto out_release;
+	}
+
+	if (hdr->version != TINYDRM_SEQ_VERSION || hdr->cmd_size != cmd_size) {
+		dev_err(dev, "%s: Unsupported version %u or command size %u\n",
+			name, hdr->version, hdr->cmd_size);
+		ret = -EINVAL;
+		goto out_release;
+	}
+
+	/* The parameters point into the data so it has to stay around */
+	size = fw->size - sizeof(*hdr);
+	data = devm_kmemdup(dev, fw->data + sizeof(*hdr), size, GFP_KERNEL);
+	if (!data) {
+		ret = -ENOMEM;
+		goto out_release;
+	}
+
+	ret = tinydrm_seq_parse(dev, seq, cmd_size, data, size);
+	if (!ret)
+		dev_info(dev, "Using init sequence from '%s'\n", name);
+
+out_release:
+	release_firmware(fw);
+
+	return ret;
+}
+
+/**
+ * devm_tinydrm_seq_load - Load init sequence
+ * @dev: Device
+ * @seq: Sequence to fill in
+ * @cmd_size: Size of the command number, 1 or 2 bytes
+ * @builtin: Built-in sequence without header
+ * @len: Length of @builtin
+ *
+ * Loads the init sequence named by the 'firmware-name' device property if
+ * present, otherwise the built-in sequence is used. The sequence is validated
+ * and split into commands so enabling the display only has to send them.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int devm_tinydrm_seq_load(struct device *dev, struct tinydrm_seq *seq,
+			  unsigned int cmd_size, const u8 *builtin, size_t len)
+{
+	const char *name;
+
+	if (!device_property_read_string(dev, "firmware-name", &name))
+		return devm_tinydrm_seq_request(dev, seq, cmd_size, name);
+
+	return tinydrm_seq_parse(dev, seq, cmd_size, builtin, len);
+}
+EXPORT_SYMBOL(devm_tinydrm_seq_load);
+
+/**
+ * tinydrm_seq_run_mipi_dbi - Send init sequence to a MIPI DBI controller
+ * @dbi: MIPI DBI structure
+ * @seq: Sequence with 1 byte commands
+ *
+ * The D/C line has to change between command and parameters, so each command
+ * is its own transfer. Delays are sleeping.
+ *
+ * Returns:
+ * Zero on success, negative error code on failure.
+ */
+int tinydrm_seq_run_mipi_dbi(struct mipi_dbi *dbi, const struct tinydrm_seq *seq)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < seq->num_cmds; i++) {
+		const struct tinydrm_seq_cmd *cmd = &seq->cmds[i];
+
+		if (tinydrm_seq_cmd_is_delay(cmd)) {
+			msleep(cmd->params[0]);
+			continue;
+		}
+
+		ret = mipi_dbi_command_stackbuf(dbi, cmd->cmd, cmd->params, cmd->len);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL(tinydrm_seq_run_mipi_dbi);
+
+MODULE_DESCRIPTION("Helpers for the tiny DRM drivers");
+MODULE_AUTHOR("Noralf Trønnes");
+MODULE_LICENSE("GPL");